@@ -16,15 +16,43 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/*
+ * libmadvmerge.so, preloaded by madvmerge.sh, marks the memory a program
+ * allocates MADV_MERGEABLE for kernel same page merging (see ksm.sh).
+ *
+ * Ranges already marked are remembered, so the malloc family only calls
+ * madvise() for pages not marked before; munmap, mremap and a shrinking break
+ * drop them again, and so do free(), realloc() and malloc_trim() for what
+ * glibc may unmap or trim behind them.
+ *
+ * MADVMERGE_MIN=<size> (K/M/G suffixes) leaves malloc family blocks smaller
+ * than that unmarked.  MADVMERGE_REGIONS=<class,...> marks only the listed
+ * classes: mmap (mmap, mremap and mprotect called by the program), brk
+ * (brk/sbrk growth), malloc (malloc family blocks), anon-large (only malloc
+ * family blocks of at least 128K, which glibc maps on their own), init (every
+ * mapping present at startup) and all, the default.  MADVMERGE_MIN=64K
+ * MADVMERGE_REGIONS=mmap,brk,anon-large keeps ksmd off small, hot heap pages.
+ * Both are read once at startup.
+ *
+ * ./madvmerge.sh ./madvmergebench [count [max_size [live]]] times malloc/free
+ * and counts the madvise() calls made; madvmerge_test.sh checks in smaps that
+ * blocks glibc unmapped or trimmed are marked again when reallocated.
+ */
+
 #define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <sys/user.h>	// PAGE_SIZE
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
 #include <errno.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #ifdef MY_DEBUG
 #include <stdio.h>
@@ -61,10 +89,13 @@
 
 static void *(*libc_malloc)(size_t) = NULL;
 static void *(*libc_realloc)(void *, size_t) = NULL;
+static void (*libc_free)(void *) = NULL;
+static int (*libc_malloc_trim)(size_t) = NULL;
 static int (*libc_brk)() = NULL;
 static void *(*libc_sbrk)(intptr_t) = NULL;
 static void *(*libc_mmap)(void *, size_t, int, int, int, off_t) = NULL;
 static void *(*libc_mremap)(void *, size_t, size_t, int flags, ...) = NULL;
+static int (*libc_munmap)(void *, size_t) = NULL;
 #ifdef TRY_CALLOC
 static void *(*libc_calloc)(size_t, size_t) = NULL;
 #endif
@@ -76,6 +107,13 @@ static void *(*libc_mmap2)(void *, size_t, int, int, int, off_t) = NULL;
 static int (*libc_mprotect)(void *, size_t, int) = NULL;
 #endif
 
+#ifdef TRY_CALLOC
+/* calloc() before dlsym() has found the real one, which dlsym() itself calls */
+static /* __thread */ int madvmerge_count = 0;
+
+static char madvmerge_array[65536];
+#endif
+
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 0
 #endif
@@ -113,30 +151,297 @@ void madvmerge_align(void *ptr, size_t *size, void **aligned)
 #endif
 }
 
+/*
+ * Page ranges already marked, sorted and coalesced, so the malloc family
+ * only calls madvise() for pages it has not seen.  Writers (the mapping
+ * hooks and misses on the malloc path) serialize on a spinlock and publish
+ * under a sequence count that readers retry on, so lookups never block.
+ * A full set starts over from the range being added.
+ */
+#define MADVMERGE_RANGES	256
+
+static uintptr_t madvmerge_lo[MADVMERGE_RANGES], madvmerge_hi[MADVMERGE_RANGES];
+static int madvmerge_nranges = 0;
+static unsigned int madvmerge_seq = 0;
+static int madvmerge_lock = 0;
+static uintptr_t madvmerge_new_lo[MADVMERGE_RANGES], madvmerge_new_hi[MADVMERGE_RANGES];
+
+/* Whether [lo, hi) lies inside one marked range, returned in *rlo and *rhi */
+static int madvmerge_marked(uintptr_t lo, uintptr_t hi, uintptr_t *rlo, uintptr_t *rhi)
+{
+	unsigned int seq;
+	int a, b, m, found;
+
+	do {
+		while (((seq = __atomic_load_n(&madvmerge_seq, __ATOMIC_ACQUIRE)) & 1) != 0)
+			sched_yield();
+		a = 0;
+		b = __atomic_load_n(&madvmerge_nranges, __ATOMIC_RELAXED);
+		if (b > MADVMERGE_RANGES)
+			b = MADVMERGE_RANGES;
+		while (a < b) {
+			m = (a + b) / 2;
+			if (__atomic_load_n(&madvmerge_hi[m], __ATOMIC_RELAXED) < hi)
+				a = m + 1;
+			else
+				b = m;
+		}
+		found = 0;
+		if (a < MADVMERGE_RANGES) {
+			*rlo = __atomic_load_n(&madvmerge_lo[a], __ATOMIC_RELAXED);
+			*rhi = __atomic_load_n(&madvmerge_hi[a], __ATOMIC_RELAXED);
+			found = a < __atomic_load_n(&madvmerge_nranges, __ATOMIC_RELAXED) && *rlo <= lo && *rhi >= hi;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&madvmerge_seq, __ATOMIC_RELAXED) != seq);
+	return found;
+}
+
+static void madvmerge_lock_take(void)
+{
+	while (__atomic_exchange_n(&madvmerge_lock, 1, __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+}
+
+static void madvmerge_lock_give(void)
+{
+	__atomic_store_n(&madvmerge_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* The child of a fork() gets only the forking thread, so no writer may be half way then */
+static void madvmerge_fork_child(void)
+{
+	if ((madvmerge_seq & 1) != 0) {
+		madvmerge_nranges = 0;
+		madvmerge_seq++;
+	}
+	madvmerge_lock_give();
+}
+
+/* Replace the set with [lo, hi) added to (add != 0) or cut out of it */
+static void madvmerge_update(uintptr_t lo, uintptr_t hi, int add)
+{
+	int i, n = 0, full = 0;
+
+	if (lo >= hi)
+		return;
+	madvmerge_lock_take();
+#define MADVMERGE_KEEP(l, h) do { \
+		if (n == MADVMERGE_RANGES) \
+			full = 1; \
+		else { \
+			madvmerge_new_lo[n] = (l); \
+			madvmerge_new_hi[n++] = (h); \
+		} \
+	} while (0)
+	for (i = 0; i < madvmerge_nranges && madvmerge_hi[i] < lo; i++)
+		MADVMERGE_KEEP(madvmerge_lo[i], madvmerge_hi[i]);
+	for (; i < madvmerge_nranges && madvmerge_lo[i] <= hi; i++) {
+		if (add) {
+			if (madvmerge_lo[i] < lo)
+				lo = madvmerge_lo[i];
+			if (madvmerge_hi[i] > hi)
+				hi = madvmerge_hi[i];
+			continue;
+		}
+		if (madvmerge_lo[i] < lo)
+			MADVMERGE_KEEP(madvmerge_lo[i], lo);
+		if (madvmerge_hi[i] > hi)
+			MADVMERGE_KEEP(hi, madvmerge_hi[i]);
+	}
+	if (add)
+		MADVMERGE_KEEP(lo, hi);
+	for (; i < madvmerge_nranges; i++)
+		MADVMERGE_KEEP(madvmerge_lo[i], madvmerge_hi[i]);
+#undef MADVMERGE_KEEP
+	if (full) {
+		n = 0;
+		if (add) {
+			madvmerge_new_lo[n] = lo;
+			madvmerge_new_hi[n++] = hi;
+		}
+	}
+	__atomic_store_n(&madvmerge_seq, madvmerge_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < n; i++) {
+		__atomic_store_n(&madvmerge_lo[i], madvmerge_new_lo[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&madvmerge_hi[i], madvmerge_new_hi[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&madvmerge_nranges, n, __ATOMIC_RELAXED);
+	__atomic_store_n(&madvmerge_seq, madvmerge_seq + 1, __ATOMIC_RELEASE);
+	madvmerge_lock_give();
+}
+
 void madvmerge_madvise_mergeable_page_aligned(void *aligned, size_t size)
 {
 	int error = errno;
 	if (size != 0 && madvise(aligned, size, MADV_MERGEABLE) != 0)
 		DEBUG_PERROR("madvise()");
+	else if (size != 0)
+		madvmerge_update((uintptr_t)aligned, ((uintptr_t)aligned + size + page_offset_mask) & page_base_mask, 1);
 	errno = error;
 }
 
 void madvmerge_madvise_mergeable(void *ptr, size_t size)
 {
 	void *aligned;
+	uintptr_t lo, hi;
 
 	madvmerge_align(ptr, &size, &aligned);
+	if (madvmerge_marked((uintptr_t)aligned, (uintptr_t)aligned + size, &lo, &hi))
+		return;
 	madvmerge_madvise_mergeable_page_aligned(aligned, size);
 }
 
+void madvmerge_unmarked(void *ptr, size_t size)
+{
+	madvmerge_update((uintptr_t)ptr & page_base_mask,
+		((uintptr_t)ptr + size + page_offset_mask) & page_base_mask, 0);
+}
+
+/*
+ * glibc hands memory back without the hooks: free() unmaps blocks it mapped
+ * on their own and shrinks thread heaps with mmap(MAP_FIXED), and free(),
+ * realloc() and malloc_trim() trim the main heap through its internal sbrk().
+ * Pages mapped again at those addresses are not marked, so a block outside
+ * the main heap leaves the set before it goes back, and whatever lies above
+ * the break after the call leaves it then.
+ */
+static uintptr_t madvmerge_heap = 0;
+
+/* Start of the main heap, field 47 (start_brk) of /proc/self/stat, else the break now */
+static uintptr_t madvmerge_heap_start(void)
+{
+	char buf[1024], *p;
+	ssize_t len;
+	int fd, field;
+
+	fd = open("/proc/self/stat", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		len = read(fd, buf, sizeof buf - 1);
+		close(fd);
+		buf[len > 0 ? len : 0] = '\0';
+		/* The command name in parentheses may hold spaces, fields count from after it */
+		p = strrchr(buf, ')');
+		for (field = 2; p != NULL && field < 47; field++)
+			if ((p = strchr(p + 1, ' ')) != NULL)
+				p++;
+		if (p != NULL && *p >= '0' && *p <= '9')
+			return strtoull(p, NULL, 10);
+	}
+	return (uintptr_t)libc_sbrk(0);
+}
+
+/* Before ptr goes back to glibc, returns the break at that point */
+static uintptr_t madvmerge_release(void *ptr)
+{
+	uintptr_t brk;
+
+	COND_ASSIGN_DLSYM_OR_DIE(sbrk);
+	brk = (uintptr_t)libc_sbrk(0);
+	if (ptr != NULL && ((uintptr_t)ptr < madvmerge_heap || (uintptr_t)ptr >= brk))
+		madvmerge_unmarked(ptr, malloc_usable_size(ptr));
+	return brk;
+}
+
+static void madvmerge_released(uintptr_t brk)
+{
+	uintptr_t now = (uintptr_t)libc_sbrk(0);
+
+	if (now < brk)
+		madvmerge_unmarked((void *)now, brk - now);
+}
+
+/* Region classes for MADVMERGE_REGIONS, all marked when it is unset */
+#define MADVMERGE_REGION_MMAP		0x01	/* mmap, mmap2, mremap and mprotect by the program */
+#define MADVMERGE_REGION_BRK		0x02	/* brk and sbrk growth */
+#define MADVMERGE_REGION_MALLOC		0x04	/* malloc family blocks */
+#define MADVMERGE_REGION_ANON_LARGE	0x08	/* malloc family blocks big enough for glibc to mmap them */
+#define MADVMERGE_REGION_INIT		0x10	/* whole address space at startup */
+#define MADVMERGE_REGION_ALL		0x1f
+
+/* glibc's default M_MMAP_THRESHOLD */
+#define MADVMERGE_ANON_LARGE	(128 << 10)
+
+static const struct {
+	const char *name;
+	unsigned int bit;
+} madvmerge_region_names[] = {
+	{ "mmap", MADVMERGE_REGION_MMAP },
+	{ "brk", MADVMERGE_REGION_BRK },
+	{ "malloc", MADVMERGE_REGION_MALLOC },
+	{ "anon-large", MADVMERGE_REGION_ANON_LARGE },
+	{ "init", MADVMERGE_REGION_INIT },
+	{ "all", MADVMERGE_REGION_ALL },
+};
+
+static unsigned int madvmerge_regions = MADVMERGE_REGION_ALL;
+static size_t madvmerge_min = 0;
+
+static size_t madvmerge_size_parse(const char *str, size_t dflt)
+{
+	char *ep = NULL;
+	unsigned long long num;
+
+	if (str == NULL || *str == '\0')
+		return dflt;
+	num = strtoull(str, &ep, 0);
+	switch (*ep) {
+	case 'g': case 'G': num <<= 10;	/* fall through */
+	case 'm': case 'M': num <<= 10;	/* fall through */
+	case 'k': case 'K': num <<= 10; ep++;
+	}
+	if (ep == str || *ep != '\0')
+		return dflt;
+	return num;
+}
+
+/* Comma separated class names, unknown ones ignored */
+static unsigned int madvmerge_regions_parse(const char *str)
+{
+	unsigned int regions = 0;
+	size_t i, len;
+
+	if (str == NULL)
+		return MADVMERGE_REGION_ALL;
+	while (*str != '\0') {
+		len = strcspn(str, ",");
+		for (i = 0; i < sizeof madvmerge_region_names / sizeof *madvmerge_region_names; i++)
+			if (strlen(madvmerge_region_names[i].name) == len
+			&& strncmp(str, madvmerge_region_names[i].name, len) == 0)
+				regions |= madvmerge_region_names[i].bit;
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+	return regions;
+}
+
+/* Mark a malloc family block if its size and class are selected */
+void madvmerge_allocated(void *ptr, size_t size, int aligned)
+{
+	if (size < madvmerge_min)
+		return;
+	if ((madvmerge_regions & MADVMERGE_REGION_MALLOC) == 0
+	&& ((madvmerge_regions & MADVMERGE_REGION_ANON_LARGE) == 0 || size < MADVMERGE_ANON_LARGE))
+		return;
+	if (aligned)
+		madvmerge_madvise_mergeable_page_aligned(ptr, size);
+	else
+		madvmerge_madvise_mergeable(ptr, size);
+}
+
 void __attribute__((constructor)) madvmerge_init()
 {
 	ASSIGN_DLSYM_IF_EXIST(malloc);
 	ASSIGN_DLSYM_IF_EXIST(realloc);
+	ASSIGN_DLSYM_IF_EXIST(free);
+	ASSIGN_DLSYM_IF_EXIST(malloc_trim);
 	ASSIGN_DLSYM_IF_EXIST(brk);
 	ASSIGN_DLSYM_IF_EXIST(sbrk);
 	ASSIGN_DLSYM_IF_EXIST(mmap);
 	ASSIGN_DLSYM_IF_EXIST(mremap);
+	ASSIGN_DLSYM_IF_EXIST(munmap);
 #ifdef TRY_CALLOC
 	ASSIGN_DLSYM_IF_EXIST(calloc);
 #endif
@@ -149,7 +454,15 @@ void __attribute__((constructor)) madvmerge_init()
 #endif
 
 	madvmerge_page_init();
+	pthread_atfork(madvmerge_lock_take, madvmerge_lock_give, madvmerge_fork_child);
+	if (libc_sbrk != NULL)
+		madvmerge_heap = madvmerge_heap_start();
+
+	madvmerge_min = madvmerge_size_parse(getenv("MADVMERGE_MIN"), 0);
+	madvmerge_regions = madvmerge_regions_parse(getenv("MADVMERGE_REGIONS"));
 
+	if ((madvmerge_regions & MADVMERGE_REGION_INIT) == 0)
+		return;
 	if (sizeof(uintptr_t) > 32) {
 		madvmerge_madvise_mergeable_page_aligned(NULL + pagesize, (1ull << (40 - 1)) - pagesize);
 		madvmerge_madvise_mergeable_page_aligned(NULL + pagesize, (1ull << (48 - 1)) - pagesize);
@@ -167,21 +480,52 @@ void *malloc(size_t size)
 	COND_ASSIGN_DLSYM_OR_DIE(malloc);
 	ptr = libc_malloc(size);
 	if (ptr != NULL)
-		madvmerge_madvise_mergeable(ptr, size);
+		madvmerge_allocated(ptr, size, 0);
 	return ptr;
 }
 
 void *realloc(void *oldptr, size_t size)
 {
 	void *ptr;
+	uintptr_t brk;
 
 	COND_ASSIGN_DLSYM_OR_DIE(realloc);
+	brk = madvmerge_release(oldptr);
 	ptr = libc_realloc(oldptr, size);
+	madvmerge_released(brk);
 	if (ptr != NULL)
-		madvmerge_madvise_mergeable(ptr, size);
+		madvmerge_allocated(ptr, size, 0);
 	return ptr;
 }
 
+void free(void *ptr)
+{
+	uintptr_t brk;
+
+	if (ptr == NULL)
+		return;
+#ifdef TRY_CALLOC
+	if ((char *)ptr >= madvmerge_array && (char *)ptr < madvmerge_array + sizeof madvmerge_array)
+		return;
+#endif
+	COND_ASSIGN_DLSYM_OR_DIE(free);
+	brk = madvmerge_release(ptr);
+	libc_free(ptr);
+	madvmerge_released(brk);
+}
+
+int malloc_trim(size_t pad)
+{
+	int ret;
+	uintptr_t brk;
+
+	COND_ASSIGN_DLSYM_OR_DIE(malloc_trim);
+	brk = madvmerge_release(NULL);
+	ret = libc_malloc_trim(pad);
+	madvmerge_released(brk);
+	return ret;
+}
+
 int brk(void *ptr)
 {
 	int ret;
@@ -191,8 +535,10 @@ int brk(void *ptr)
 	COND_ASSIGN_DLSYM_OR_DIE(brk);
 	prev = libc_sbrk(0);
 	ret = libc_brk(ptr);
-	if (ret == 0 && (uintptr_t)ptr > (uintptr_t)prev)
+	if (ret == 0 && (uintptr_t)ptr > (uintptr_t)prev && (madvmerge_regions & MADVMERGE_REGION_BRK) != 0)
 		madvmerge_madvise_mergeable(prev, (intptr_t)ptr - (intptr_t)prev);
+	else if (ret == 0 && (uintptr_t)ptr < (uintptr_t)prev)
+		madvmerge_unmarked(ptr, (intptr_t)prev - (intptr_t)ptr);
 	return ret;
 }
 
@@ -202,8 +548,10 @@ void *sbrk(intptr_t increment)
 
 	COND_ASSIGN_DLSYM_OR_DIE(sbrk);
 	prev = libc_sbrk(increment);
-	if (prev != MAP_FAILED && increment > 0)
+	if (prev != MAP_FAILED && increment > 0 && (madvmerge_regions & MADVMERGE_REGION_BRK) != 0)
 		madvmerge_madvise_mergeable(prev, increment);
+	else if (prev != MAP_FAILED && increment < 0)
+		madvmerge_unmarked(prev + increment, -increment);
 	return prev;
 }
 
@@ -213,11 +561,16 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offs)
 
 	COND_ASSIGN_DLSYM_OR_DIE(mmap);
 	ptr = libc_mmap(addr, len, prot, flags, fd, offs);
-	if (ptr != MAP_FAILED)
+	if (ptr != MAP_FAILED && (madvmerge_regions & MADVMERGE_REGION_MMAP) != 0)
 		madvmerge_madvise_mergeable_page_aligned(ptr, len);
 	return ptr;
 }
 
+/* Large file offsets rename the hook to mmap64, programs on 64-bit call mmap */
+#if __SIZEOF_LONG__ == 8
+__asm__(".globl mmap\n\t.set mmap, mmap64");
+#endif
+
 void *mremap(void *oldaddr, size_t oldsize, size_t newsize, int flags, ...)
 {
 	va_list ap;
@@ -231,17 +584,27 @@ void *mremap(void *oldaddr, size_t oldsize, size_t newsize, int flags, ...)
 		newaddr = va_arg(ap, void *);
 		ptr = libc_mremap(oldaddr, oldsize, newsize, flags, newaddr);
 	}
-	if (ptr != MAP_FAILED)
-		madvmerge_madvise_mergeable(ptr, newsize);
+	if (ptr != MAP_FAILED) {
+		madvmerge_unmarked(oldaddr, oldsize);
+		if ((madvmerge_regions & MADVMERGE_REGION_MMAP) != 0)
+			madvmerge_madvise_mergeable(ptr, newsize);
+	}
 	va_end(ap);
 	return ptr;
 }
 
-#ifdef TRY_CALLOC
+int munmap(void *addr, size_t len)
+{
+	int ret;
 
-static /* __thread */ int madvmerge_count = 0;
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	ret = libc_munmap(addr, len);
+	if (ret == 0)
+		madvmerge_unmarked(addr, len);
+	return ret;
+}
 
-static char madvmerge_array[65536];
+#ifdef TRY_CALLOC
 
 void *calloc(size_t nmemb, size_t size)
 {
@@ -254,7 +617,7 @@ void *calloc(size_t nmemb, size_t size)
 
 		ptr = libc_calloc(nmemb, size);
 		if (ptr != NULL)
-			madvmerge_madvise_mergeable(ptr, nmemb * size);
+			madvmerge_allocated(ptr, nmemb * size, 0);
 
 #if 0
 		COND_ASSIGN_DLSYM_OR_DIE(malloc);
@@ -280,7 +643,7 @@ void *valloc(size_t size)
 	COND_ASSIGN_DLSYM_OR_DIE(valloc);
 	aligned = libc_valloc(size);
 	if (aligned != NULL)
-		madvmerge_madvise_mergeable_page_aligned(aligned, size);
+		madvmerge_allocated(aligned, size, 1);
 	return aligned;
 }
 
@@ -291,7 +654,7 @@ void *memalign(size_t boundary, size_t size)
 	COND_ASSIGN_DLSYM_OR_DIE(memalign);
 	ptr = libc_memalign(boundary, size);
 	if (ptr != NULL)
-		madvmerge_madvise_mergeable(ptr, size);
+		madvmerge_allocated(ptr, size, 0);
 	return ptr;
 }
 
@@ -302,7 +665,7 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
 	COND_ASSIGN_DLSYM_OR_DIE(posix_memalign);
 	ret = libc_posix_memalign(memptr, alignment, size);
 	if (ret == 0)
-		madvmerge_madvise_mergeable(*memptr, size);
+		madvmerge_allocated(*memptr, size, 0);
 	return ret;
 }
 
@@ -312,7 +675,7 @@ void *mmap2(void *addr, size_t len, int prot, int flags, int fd, off_t pgoffs)
 
 	COND_ASSIGN_DLSYM_OR_DIE(mmap2);
 	ptr = libc_mmap2(addr, len, prot, flags, fd, pgoffs);
-	if (ptr != MAP_FAILED)
+	if (ptr != MAP_FAILED && (madvmerge_regions & MADVMERGE_REGION_MMAP) != 0)
 		madvmerge_madvise_mergeable_page_aligned(ptr, len);
 	return ptr;
 }
@@ -325,7 +688,7 @@ int mprotect(void *addr, size_t len, int prot)
 
 	COND_ASSIGN_DLSYM_OR_DIE(mprotect);
 	ret = libc_mprotect(addr, len, prot);
-	if (ret == 0 && prot != PROT_NONE)
+	if (ret == 0 && prot != PROT_NONE && (madvmerge_regions & MADVMERGE_REGION_MMAP) != 0)
 		madvmerge_madvise_mergeable_page_aligned(addr, len);
 	return ret;
 }
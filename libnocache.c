@@ -16,6 +16,124 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/*
+ * libnocache.so, preloaded by nocache.sh, keeps the file content a program
+ * reads and writes out of the page cache.  Sizes take K/M/G suffixes, times
+ * are in ms.  Settings come from the environment:
+ *
+ * NOCACHE_OFF=1	load but leave everything cached.
+ * NOCACHE_BATCH	bytes a descriptor moves between evictions (default 8M).
+ *			Only the byte ranges actually read or written are
+ *			evicted, up to the last NOCACHE_ALIGN boundary (default
+ *			2M, 0 for none) so large folios are not left straddling
+ *			the edge; the rest waits for the next batch or close.
+ *			So 0 evicts once per 2M moved, and after every call only
+ *			with NOCACHE_ALIGN=0 as well.
+ * NOCACHE_DEFAULT	policy for files no rule matches.  Policies are none,
+ *			behind (evict-behind, the default), close (evict at
+ *			close), full (whole-file DONTNEED), direct and noreuse.
+ * NOCACHE_RULES	"policy:pattern" entries separated by ';' or newlines,
+ *			also read from the file NOCACHE_RULES_FILE, matched
+ *			first-wins against the path at open; a pattern with *?[
+ *			is a glob, otherwise a path prefix, e.g.
+ *			NOCACHE_RULES='none:/var/lib/db/;close:*.dump'.
+ * NOCACHE_AHEAD	streaming for sequential readers: readahead stays on,
+ *			that much is prefetched ahead of the read position and
+ *			NOCACHE_BEHIND (default 1M) stays resident behind it.
+ * NOCACHE_WRITEBEHIND	start writeback of each chunk of that size once
+ *			written, and drop it once a later chunk is submitted.
+ * NOCACHE_WORKER	entries of a lock-free queue that hands advice calls to
+ *			a background thread; close() waits for its descriptor.
+ * NOCACHE_BUDGET	bytes evict-behind files may keep cached for the whole
+ *			process, least recently used ranges evicted beyond it and
+ *			the rest at close.  NOCACHE_BUDGET_CHECK=1 skips ranges
+ *			cachestat() finds gone, NOCACHE_BUDGET_RANGES sizes the
+ *			range pool (default 4096).
+ * NOCACHE_AGE		evict evict-behind ranges only once idle that long, so
+ *			a file read twice in a row is read from disk once.
+ *			Records are at most 8M; those of closed files wait on a
+ *			duplicate descriptor for up to NOCACHE_AGE_FILES
+ *			(default 64) files, the rest go at close or exit.
+ * NOCACHE_MAPS		file mappings tracked from mmap() to munmap() or
+ *			mremap(), each holding a duplicate fd (default 64, 0
+ *			disables).  Duplicates take the top quarter of the soft
+ *			RLIMIT_NOFILE (at most 1024 fds below 4096) and are not
+ *			made once it is full.  The range behind released
+ *			addresses is evicted then.  msync() evicts what is no
+ *			longer mapped of its range and keeps the mapping;
+ *			with MS_ASYNC it returns at once and a thread evicts
+ *			after the writeback.  Mappings left at exit are
+ *			dropped unless private and writable.
+ * NOCACHE_MAP_COLD	interval at which a thread counts the resident pages of
+ *			each 2M chunk of the tracked mappings.  A chunk that did
+ *			not grow gets MADV_COLD once; under NOCACHE_PSI pressure
+ *			it gets MADV_PAGEOUT once its count drops or has held
+ *			for 4 passes, never again if it refaults afterwards
+ *			(Linux 5.4+; private writable, WILLNEED and hot mappings
+ *			excluded).
+ * NOCACHE_DIRECT_MIN	first transfer (default 64k) that switches a direct
+ *			policy file to O_DIRECT; the partial blocks of unaligned
+ *			requests then go through the page cache, the whole blocks
+ *			through a per-thread NOCACHE_DIRECT_CHUNK (default 1m)
+ *			bounce buffer, and what the kernel refuses (append mode,
+ *			splice) reverts to behind.
+ * NOCACHE_PRESERVE=1	leave pages that were cached before a descriptor or
+ *			mapping was first seen, one bit per page.
+ * NOCACHE_PSI		only evict while the "some" avg10 of
+ *			/proc/pressure/memory (or NOCACHE_PSI_PATH) is at least
+ *			that percentage, until it falls to NOCACHE_PSI_LOW
+ *			(default half); reread every NOCACHE_PSI_INTERVAL
+ *			(default 1000) and on a kernel PSI trigger.
+ * NOCACHE_HOT		opens, mappings or re-reads after which a count-min
+ *			sketch keeps a file cached; NOCACHE_HOT_WIDTH counters
+ *			per row (default 4096) halve every NOCACHE_HOT_DECAY
+ *			events (default 16 x width), NOCACHE_HOT_SHM=<name>
+ *			shares the sketch via /dev/shm/<name>.
+ * NOCACHE_CONTROL	file polled every NOCACHE_CONTROL_INTERVAL (default 1000)
+ *			for NOCACHE_OFF, NOCACHE_DEFAULT, NOCACHE_RULES and
+ *			NOCACHE_BUDGET lines replacing the environment's, for
+ *			files opened afterwards; deleting it restores them.
+ * NOCACHE_STATS	path or fd that gets one line per process at exit with
+ *			call counts, bytes, advice calls, failures, ns spent and
+ *			errnos.  NOCACHE_STATS_SHM=<name> keeps them live in
+ *			/dev/shm/<name>.<pid>: magic "NOCACHE1", u32 count, u32
+ *			offset of the names, u64 pid, count u64 counters, then
+ *			the names NUL separated.
+ * NOCACHE_TRACE	file that gets a 48-byte record (time, dev, inode,
+ *			cached and dirty pages, pid, page size) per open file,
+ *			up to NOCACHE_TRACE_FILES (default 64) per tick round
+ *			robin, every NOCACHE_TRACE_INTERVAL (default 1000);
+ *			./nocachetrace [-b] <file> decodes it to TSV.
+ * NOCACHE_DAEMON	socket of a running ./nocached [-d delay_ms] [-n
+ *			max_files] [-r evictions_per_s], which gets every
+ *			eviction with the descriptor attached, merges a file's
+ *			requests from all processes for delay_ms (default 100)
+ *			and evicts at most -r files a second (default 1000, 0
+ *			unlimited).  Without it, with its queue full, or for
+ *			files with a NOCACHE_PRESERVE bitmap (the merged span
+ *			would cover the kept pages), processes evict locally.
+ * NOCACHE_SYNC_WINDOW	with COPT=-DFORCE_SYNC, files closed after writing wait
+ *			that long (default 1000, 0 syncs in close()) or until
+ *			NOCACHE_SYNC_FILES (default 64) wait, then one syncfs()
+ *			per filesystem runs and the clean pages are evicted.
+ *
+ * Besides the plain and large file read, write, open and mmap calls,
+ * preadv2/pwritev2, copy_file_range, fallocate zeroing and stdio streams are
+ * covered; stdio looks up the descriptor position once per NOCACHE_BATCH
+ * bytes and at fclose() or exit.  The program's own posix_fadvise() and
+ * madvise() advice passes through and is kept: after RANDOM, SEQUENTIAL or
+ * NORMAL the library no longer switches the file itself (RANDOM also turns
+ * off NOCACHE_AHEAD), madvise() DONTNEED evicts the file range behind a
+ * mapping and WILLNEED or SEQUENTIAL keeps msync() and exit from evicting
+ * it.  The noreuse policy, and POSIX_FADV_NOREUSE on an evict-behind file,
+ * leave the file to the kernel's use-once handling (Linux 6.3+, behind
+ * before that).
+ *
+ * nocache_test.sh checks that cat, cp, dd and a stdio program leave nothing
+ * cached, nocache_bench.sh calls|direct|age measures the advice calls per
+ * GiB, direct against behind and the cost of aging.
+ */
+
 #define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define _POSIX_C_SOURCE 200112L
@@ -23,16 +141,30 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
-#ifdef MY_DEBUG
 #include <stdio.h>
-#endif
+#include <stdio_ext.h>
+#include <string.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <time.h>
 
 #define COND_ASSIGN_DLSYM_OR_DIE(name)					\
 	do {								\
@@ -48,22 +180,52 @@
 		*(void **)(&libc_##name) = dlsym(RTLD_NEXT, #name);	\
 	} while (0)
 
+/*
+ * _FILE_OFFSET_BITS turns the large file hooks into their *64 names, which
+ * forward to the *64 libc entry points.  Where off_t is 64 bits either way
+ * the plain names share that ABI and are exported as aliases, otherwise
+ * they get wrappers of their own near the end of this file.
+ */
+#if __SIZEOF_LONG__ == 8
+#define NOCACHE_SYM64(name, sym64)	#name
+#define NOCACHE_ALIAS64(name, sym64)	__asm__(".globl " #name "\n\t.set " #name ", " #sym64)
+#else
+#define NOCACHE_SYM64(name, sym64)	#sym64
+#define NOCACHE_ALIAS64(name, sym64)
+#endif
+
+#define COND_ASSIGN_DLSYM64_OR_DIE(name, sym64)				\
+	do {								\
+		if (libc_##name == NULL) {					\
+			*(void **)(&libc_##name) = dlsym(RTLD_NEXT, NOCACHE_SYM64(name, sym64));	\
+			if (libc_##name == NULL)				\
+			_exit(EXIT_FAILURE);					\
+		}							\
+	} while (0)
+
+#define ASSIGN_DLSYM64_IF_EXIST(name, sym64)				\
+	do {								\
+		*(void **)(&libc_##name) = dlsym(RTLD_NEXT, NOCACHE_SYM64(name, sym64));	\
+	} while (0)
+
 #ifdef MY_DEBUG
 #define DEBUG_PERROR(msg)	do { if (msg != NULL) perror(msg); } while (0)
 #else
-#define DEBUG_PERROR(msg)	do { } while (0)
+#define DEBUG_PERROR(msg)	do { (void)(msg); } while (0)
 #endif
 
 #ifdef FORCE_SYNC
-#define COND_CALL_SYNC(name, fd, msg)					\
+#define COND_CALL_SYNC_(name, fd, msg)					\
 	do {								\
 		int error = errno;					\
 		if (libc_##name == NULL)				\
 			ASSIGN_DLSYM_IF_EXIST(name);			\
 		if (libc_##name != NULL && libc_##name(fd) != 0)	\
 			DEBUG_PERROR(#name msg);			\
-		errno = error;						/
+		errno = error;						\
 	} while (0)
+/* One more level so SYNC_CALL is expanded before the ## pasting */
+#define COND_CALL_SYNC(name, fd, msg)	COND_CALL_SYNC_(name, fd, msg)
 #else
 #define COND_CALL_SYNC(name, fd, msg)	do { } while (0)
 #endif
@@ -89,352 +251,4813 @@ static int (*libc_fsync)(int) = NULL;
 static int (*libc_fdatasync)(int) = NULL;
 #endif
 static int (*libc_close)(int) = NULL;
+static int (*libc_dup2)(int, int) = NULL;
+static int (*libc_dup3)(int, int, int) = NULL;
 static void *(*libc_mmap)(void *, size_t, int, int, int, off_t) = NULL;
 static void *(*libc_mmap2)(void *, size_t, int, int, int, off_t) = NULL;
 static int (*libc_msync)(void *, size_t, int) = NULL;
 static int (*libc_munmap)(void *, size_t) = NULL;
+static void *(*libc_mremap)(void *, size_t, size_t, int, ...) = NULL;
+static int (*libc_mprotect)(void *, size_t, int) = NULL;
+static int (*libc_madvise)(void *, size_t, int) = NULL;
+static int (*libc_posix_fadvise)(int, off_t, off_t, int) = NULL;
 static ssize_t (*libc_vmsplice)(int, const struct iovec *, unsigned long, unsigned int) = NULL;
 static ssize_t (*libc_splice)(int, loff_t *, int, loff_t *, size_t, unsigned int) = NULL;
 static ssize_t (*libc_sendfile)(int, int, off_t *, size_t) = NULL;
+static ssize_t (*libc_preadv2)(int, const struct iovec *, int, off_t, int) = NULL;
+static ssize_t (*libc_pwritev2)(int, const struct iovec *, int, off_t, int) = NULL;
+static ssize_t (*libc_copy_file_range)(int, loff_t *, int, loff_t *, size_t, unsigned int) = NULL;
+static int (*libc_fallocate)(int, int, off_t, off_t) = NULL;
+static FILE *(*libc_fopen)(const char *, const char *) = NULL;
+static FILE *(*libc_freopen)(const char *, const char *, FILE *) = NULL;
+static int (*libc_fclose)(FILE *) = NULL;
+static size_t (*libc_fread)(void *, size_t, size_t, FILE *) = NULL;
+static size_t (*libc_fwrite)(const void *, size_t, size_t, FILE *) = NULL;
+static size_t (*libc_fread_unlocked)(void *, size_t, size_t, FILE *) = NULL;
+static size_t (*libc_fwrite_unlocked)(const void *, size_t, size_t, FILE *) = NULL;
+static char *(*libc_fgets)(char *, int, FILE *) = NULL;
+static char *(*libc_fgets_unlocked)(char *, int, FILE *) = NULL;
+static int (*libc_fputs)(const char *, FILE *) = NULL;
+static int (*libc_fputs_unlocked)(const char *, FILE *) = NULL;
+static ssize_t (*libc_getline)(char **, size_t *, FILE *) = NULL;
+static ssize_t (*libc_getdelim)(char **, size_t *, int, FILE *) = NULL;
+static int (*libc_vfprintf)(FILE *, const char *, va_list) = NULL;
+static off_t (*libc_lseek)(int, off_t, int) = NULL;
 
-void __attribute__((constructor)) nocache_init(void)
-{
-	ASSIGN_DLSYM_IF_EXIST(open);
-	ASSIGN_DLSYM_IF_EXIST(openat);
-	ASSIGN_DLSYM_IF_EXIST(read);
-	ASSIGN_DLSYM_IF_EXIST(write);
-	ASSIGN_DLSYM_IF_EXIST(pread);
-	ASSIGN_DLSYM_IF_EXIST(pwrite);
-	ASSIGN_DLSYM_IF_EXIST(readv);
-	ASSIGN_DLSYM_IF_EXIST(writev);
-	ASSIGN_DLSYM_IF_EXIST(preadv);
-	ASSIGN_DLSYM_IF_EXIST(pwritev);
-	ASSIGN_DLSYM_IF_EXIST(fsync);
-#if _POSIX_SYNCHRONIZED_IO > 0
-	ASSIGN_DLSYM_IF_EXIST(fdatasync);
-#endif
-	ASSIGN_DLSYM_IF_EXIST(close);
-	ASSIGN_DLSYM_IF_EXIST(mmap);
-	ASSIGN_DLSYM_IF_EXIST(mmap2);
-	ASSIGN_DLSYM_IF_EXIST(msync);
-	ASSIGN_DLSYM_IF_EXIST(munmap);
-	ASSIGN_DLSYM_IF_EXIST(vmsplice);
-	ASSIGN_DLSYM_IF_EXIST(splice);
-	ASSIGN_DLSYM_IF_EXIST(sendfile);
-}
+#define NOCACHE_BATCH_DEFAULT	(8ul << 20)
+#define NOCACHE_FDS_MAX		65536
 
-#define NOCACHE_PERROR(fd, msg) 		\
-	do {					\
-		int error = errno;		\
-		if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)	\
-			DEBUG_PERROR(msg);	\
-		errno = error;			\
-	} while (0)
+#define NOCACHE_EOF		((off_t)INT64_MAX)
+#define NOCACHE_OFF_CUR		((off_t)-1)
 
-#define NOCACHE_NOTSEQ_PERROR(fd, msg) 		\
-	do {					\
-		int error = errno;		\
-		if (posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM) != 0)	\
-			DEBUG_PERROR(msg);	\
-		errno = error;			\
-	} while (0)
+#define NOCACHE_IO_READ		0
+#define NOCACHE_IO_WRITE	1
 
-#define NOCACHE_FD_PERROR(fd, msg)		\
-	do {					\
-		NOCACHE_NOTSEQ_PERROR(fd, msg);	\
-		NOCACHE_PERROR(fd, msg);	\
-	} while (0)
+#define NOCACHE_FD_SEEN		0x01
+#define NOCACHE_FD_POS		0x02
+#define NOCACHE_FD_APPEND	0x04
+#define NOCACHE_FD_NOSEEK	0x08
+#define NOCACHE_FD_STREAM	0x10
+#define NOCACHE_FD_SKIP		0x20
+#define NOCACHE_FD_MAP		0x40
+#define NOCACHE_FD_STDIO	0x80
 
-#if 1
-#define NOCACHE_MAP_PERROR(addr, size, msg)	\
-	do { 					\
-		(void)addr;			\
-		(void)size;			\
-		(void)msg;			\
-	} while (0)
-#else
-#define NOCACHE_MAP_PERROR(addr, size, msg)	\
-	do {					\
-		int error = errno;		\
-		if (madvise(addr, size, MADV_DONTNEED) != 0)	\
-			DEBUG_PERROR(msg);	\
-		errno = error;			\
-	} while (0)
+#define NOCACHE_POLICY_BEHIND	0
+#define NOCACHE_POLICY_NONE	1
+#define NOCACHE_POLICY_CLOSE	2
+#define NOCACHE_POLICY_FULL	3
+#define NOCACHE_POLICY_DIRECT	4
+#define NOCACHE_POLICY_NOREUSE	5
+
+/* Last access pattern the program declared with posix_fadvise(), NOCACHE_HINT_NONE until it does */
+#define NOCACHE_HINT_NONE	0xff
+
+#define NOCACHE_RULES_CHUNK	4096
+#define NOCACHE_RANGES_DEFAULT	4096
+
+#ifndef POSIX_FADV_NOREUSE
+#define POSIX_FADV_NOREUSE	5
 #endif
 
-#define NOCACHE_BUF_PERROR(ptr, length, msg)	\
-	do {					\
-		size_t len;			\
-		void *base;			\
-		base = (void *)((uintptr_t)ptr & ~(uintptr_t)0x0fff);	\
-		len = length + ((uintptr_t)ptr & (uintptr_t)0x0fff);	\
-		len = (len + 0x1000 - 1) & ~(size_t)0x0fff;	\
-		NOCACHE_MAP_PERROR(base, len, msg);	\
-	} while (0)
+#ifndef MADV_COLD
+#define MADV_COLD		20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT		21
+#endif
 
-#define NOCACHE_IOV_PERROR(iov, num, msg)	\
-	do {					\
-		long i;				\
-		const struct iovec *piov;	\
-		for (i = 0, piov = iov; i < (long)num; i++, piov++) {	\
-			NOCACHE_BUF_PERROR(piov->iov_base, piov->iov_len, msg);	\
-		}				\
-	} while (0)
+#ifndef __NR_cachestat
+#define __NR_cachestat		451
+#endif
 
-int open(const char *pathname, int flags, ...)
-{
-	va_list ap;
+struct nocache_cachestat_range {
+	uint64_t off;
+	uint64_t len;
+};
+
+struct nocache_cachestat {
+	uint64_t nr_cache;
+	uint64_t nr_dirty;
+	uint64_t nr_writeback;
+	uint64_t nr_evicted;
+	uint64_t nr_recently_evicted;
+};
+
+#define NOCACHE_SEQ_MIN		2
+#define NOCACHE_BEHIND_DEFAULT	(1ul << 20)
+#define NOCACHE_ALIGN_DEFAULT	(2ul << 20)
+
+struct nocache_fd {
+	unsigned char flags;
+	unsigned char lock;
+	unsigned char seq;
+	unsigned char policy;
+	unsigned char direct;
+	unsigned char hint;
+	unsigned char flush;
+	unsigned int dalign;
+	dev_t dev;
+	ino_t ino;
+	off_t pos;
+	off_t next, ra;
+	off_t lo, hi;
+	off_t wlo, whi;
+	off_t wb_lo, wb_sub, wnext;
+	size_t pending;
+	unsigned long queued;
+	int ranges;
+	off_t sio;
+	size_t sio_count;
+	unsigned long *keep;
+	size_t npages;
+	off_t rend;
+	/* I/O done while another thread held the entry, at known offsets and through the position */
+	size_t lost, lost_cur;
+	off_t lost_lo, lost_hi;
+};
+
+static struct nocache_fd *nocache_fds = NULL;
+static long nocache_nfds = 0;
+static int nocache_fdhi = -1;
+static size_t nocache_batch = NOCACHE_BATCH_DEFAULT;
+static size_t nocache_ahead = 0;
+static size_t nocache_behind = NOCACHE_BEHIND_DEFAULT;
+static size_t nocache_step = NOCACHE_BATCH_DEFAULT;
+static size_t nocache_wbehind = 0;
+static size_t nocache_align = NOCACHE_ALIGN_DEFAULT - 1;
+
+#define NOCACHE_DIRECT_MIN_DEFAULT	(64ul << 10)
+#define NOCACHE_DIRECT_CHUNK_DEFAULT	(1ul << 20)
+#define NOCACHE_DIRECT_ALIGN		512
+#define NOCACHE_DIRECT_FALLBACK		((ssize_t)-2)
+
+static int nocache_preserve = 0;
+
+#define NOCACHE_HOT_MAGIC	"NOCACHEH"
+#define NOCACHE_HOT_DEPTH	4
+#define NOCACHE_HOT_WIDTH_DEFAULT	4096
+
+struct nocache_hot {
+	char magic[8];
+	uint32_t width;
+	uint32_t state;
+	uint64_t events;
+	uint32_t count[];
+};
+
+static struct nocache_hot *nocache_hot = NULL;
+static uint32_t nocache_hot_min = 0;
+static uint64_t nocache_hot_decay = 0;
+
+#define NOCACHE_PSI_PATH_DEFAULT	"/proc/pressure/memory"
+#define NOCACHE_PSI_INTERVAL_DEFAULT	1000
+#define NOCACHE_PSI_WINDOW		2000000
+#define NOCACHE_PSI_HOLD		10000
+
+static unsigned long nocache_psi_high = 0;
+static unsigned long nocache_psi_low = 0;
+static size_t nocache_psi_ms = NOCACHE_PSI_INTERVAL_DEFAULT;
+static int nocache_psi_fd = -1;
+static int nocache_psi_tfd = -1;
+static int nocache_psi_on = 1;
+static int nocache_psi_state = 0;
+
+#define NOCACHE_CONTROL_INTERVAL_DEFAULT	1000
+
+static char *nocache_control_path = NULL;
+static size_t nocache_control_ms = NOCACHE_CONTROL_INTERVAL_DEFAULT;
+static struct stat nocache_control_st;
+static int nocache_control_seen = 0;
+static int nocache_control_state = 0;
+
+#define NOCACHE_TRACE_MAGIC	"NCTRACE1"
+#define NOCACHE_TRACE_INTERVAL_DEFAULT	1000
+#define NOCACHE_TRACE_FILES_DEFAULT	64
+#define NOCACHE_TRACE_BATCH	64
+#define NOCACHE_TRACE_VEC	4096
+
+/* Trace file records, the first one carries the magic in place of the time */
+struct nocache_trace_rec {
+	uint64_t ns;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t cached;
+	uint64_t dirty;
+	uint32_t pid;
+	uint32_t pagesize;
+};
+
+static int nocache_trace_fd = -1;
+static size_t nocache_trace_ms = NOCACHE_TRACE_INTERVAL_DEFAULT;
+static size_t nocache_trace_files = NOCACHE_TRACE_FILES_DEFAULT;
+static int nocache_trace_next = 0;
+static int nocache_trace_cachestat = 1;
+static int nocache_trace_state = 0;
+
+/* Datagram to nocached, the descriptor travels as SCM_RIGHTS; keep in step with nocached.c */
+#define NOCACHE_DAEMON_VERSION	1
+
+struct nocache_daemon_msg {
+	uint32_t version;
+	uint32_t pid;
+	int64_t off;
+	int64_t len;
+};
+
+static char *nocache_daemon_path = NULL;
+static int nocache_daemon_fd = -1;
+static int nocache_daemon_state = 0;
+/* Senders inside sendmsg() plus one for the connection; the last one out closes the socket */
+static int nocache_daemon_refs = 0;
+
+static int nocache_direct = 0;
+/* POSIX_FADV_NOREUSE does something from Linux 6.3 on, before that it is accepted and ignored */
+static int nocache_noreuse = 0;
+static size_t nocache_direct_min = NOCACHE_DIRECT_MIN_DEFAULT;
+static size_t nocache_direct_chunk = NOCACHE_DIRECT_CHUNK_DEFAULT;
+static pthread_key_t nocache_direct_key;
+
+struct nocache_rec {
+	unsigned long seq;
 	int fd;
-	mode_t mode = 0;
+	int advice;
+	off_t lo, hi;
+};
 
-	va_start(ap, flags);
-	if ((flags & O_CREAT) != 0)
-		mode = va_arg(ap, mode_t);
-	va_end(ap);
-	COND_ASSIGN_DLSYM_OR_DIE(open);
-	fd = libc_open(pathname, flags, mode);
-	if (fd >= 0)
-		NOCACHE_FD_PERROR(fd, NULL);
-	return fd;
-}
+#define NOCACHE_WORKER_BATCH	64
 
-int openat(int dirfd, const char *pathname, int flags, ...)
-{
-	va_list ap;
+static struct nocache_rec *nocache_q = NULL;
+/* Sized for deferred msync() alone unless NOCACHE_WORKER hands it all advice */
+static unsigned long nocache_qmask = NOCACHE_WORKER_BATCH - 1;
+static int nocache_worker_all = 0;
+static unsigned long nocache_qhead = 0;
+static unsigned long nocache_qtail = 0;
+static int nocache_qsleep = 0;
+static int nocache_qstate = 0;
+static sem_t nocache_qsem;
+
+struct nocache_range {
 	int fd;
-	mode_t mode = 0;
+	int prev, next;
+	int fprev, fnext;
+	off_t lo, hi;
+	uint64_t used;
+};
 
-	va_start(ap, flags);
-	if ((flags & O_CREAT) != 0)
-		mode = va_arg(ap, mode_t);
-	va_end(ap);
-	COND_ASSIGN_DLSYM_OR_DIE(openat);
-	fd = libc_openat(dirfd, pathname, flags, mode);
-	if (fd >= 0)
-		NOCACHE_FD_PERROR(fd, NULL);
-	return fd;
-}
+static struct nocache_range *nocache_ranges = NULL;
+static int nocache_nranges = 0;
+static int nocache_lru_head = 0;
+static int nocache_lru_tail = 0;
+static int nocache_range_free = 0;
+static size_t nocache_cached = 0;
+static int nocache_budget_check = 0;
+static pthread_mutex_t nocache_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NOCACHE_AGE_FILES_DEFAULT	64
+/* Longest record while aging, whatever NOCACHE_BATCH is, so a stream ages in pieces */
+#define NOCACHE_AGE_RANGE	(8 << 20)
 
-ssize_t read(int fd, void *buf, size_t count)
-{
-	ssize_t ret;
+static uint64_t nocache_age_ns = 0;
+static size_t nocache_age_files = NOCACHE_AGE_FILES_DEFAULT;
+static size_t nocache_age_dups = 0;
+static int nocache_age_state = 0;
+static int nocache_exiting = 0;
 
-	COND_ASSIGN_DLSYM_OR_DIE(read);
-	ret = libc_read(fd, buf, count);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside read()");
-		NOCACHE_BUF_PERROR(buf, count, "posix_fadvise(POSIX_FADV_DONTNEED) inside read()");
-	}
-	return ret;
-}
+#define NOCACHE_MAPS_DEFAULT	64
 
-ssize_t write(int fd, const void *buf, size_t count)
+/*
+ * Duplicates the library holds sit in the top quarter of the soft
+ * RLIMIT_NOFILE, below at most this, so the program keeps the low numbers it
+ * expects; once that quarter is full nothing more is held.
+ */
+#define NOCACHE_DUP_TOP		4096
+
+#define NOCACHE_MAP_PRIVATE	0x01
+#define NOCACHE_MAP_WRITE	0x02
+#define NOCACHE_MAP_WILLNEED	0x04
+
+struct nocache_map {
+	uintptr_t lo, hi;
+	off_t off;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	int flags;
+	uint16_t *age;
+	size_t nage;
+};
+
+static struct nocache_map *nocache_maps = NULL;
+static int nocache_nmaps = 0;
+static int nocache_maps_max = 0;
+static uintptr_t nocache_pagemask = 4095;
+static pthread_mutex_t nocache_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define NOCACHE_MAP_COLD_CHUNK	(2ul << 20)
+#define NOCACHE_MAP_COLD_BATCH	256
+
+/*
+ * Per chunk of a mapping: resident pages at the last scan (at most 512),
+ * walks in a row under pressure without growth, whether it refaulted after
+ * a pageout, and which advice it got since it last grew
+ */
+#define NOCACHE_AGE_COUNT	0x03ff
+#define NOCACHE_AGE_IDLE	0x1c00
+#define NOCACHE_AGE_IDLE_ONE	0x0400
+#define NOCACHE_AGE_HOT		0x2000
+#define NOCACHE_AGE_COLD	0x4000
+#define NOCACHE_AGE_OUT		0x8000
+
+/* Idle walks under pressure before a chunk whose residency holds steady is paged out */
+#define NOCACHE_MAP_COLD_WALKS	4
+
+static size_t nocache_map_cold_ms = 0;
+static int nocache_map_cold_state = 0;
+
+#define NOCACHE_SYNC_WINDOW_DEFAULT	1000
+#define NOCACHE_SYNC_FILES_DEFAULT	64
+
+struct nocache_sync {
+	int fd;
+	dev_t dev;
+};
+
+static struct nocache_sync *nocache_syncs = NULL;
+static struct nocache_sync *nocache_syncs_spare = NULL;
+static int nocache_nsyncs = 0;
+static int nocache_syncs_max = 0;
+static size_t nocache_sync_ms = NOCACHE_SYNC_WINDOW_DEFAULT;
+static int nocache_sync_state = 0;
+static pthread_mutex_t nocache_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t nocache_sync_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t nocache_size_parse(const char *str, size_t dflt)
 {
-	ssize_t ret;
+	char *ep = NULL;
+	unsigned long long num;
 
-	COND_ASSIGN_DLSYM_OR_DIE(write);
-	ret = libc_write(fd, buf, count);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside write()");
-		NOCACHE_BUF_PERROR(buf, count, "posix_fadvise(POSIX_FADV_DONTNEED) inside write()");
+	if (str == NULL || *str == '\0')
+		return dflt;
+	num = strtoull(str, &ep, 0);
+	switch (*ep) {
+	case 'g': case 'G': num <<= 10;	/* fall through */
+	case 'm': case 'M': num <<= 10;	/* fall through */
+	case 'k': case 'K': num <<= 10; ep++;
 	}
-	return ret;
+	if (ep == str || *ep != '\0')
+		return dflt;
+	return num;
 }
 
-ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+static size_t nocache_env_size(const char *name, size_t dflt)
 {
-	ssize_t ret;
-
-	COND_ASSIGN_DLSYM_OR_DIE(pread);
-	ret = libc_pread(fd, buf, count, offset);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
-		NOCACHE_BUF_PERROR(buf, count, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
-	}
-	return ret;
+	return nocache_size_parse(getenv(name), dflt);
 }
 
-ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+static void nocache_fds_init(void)
 {
-	ssize_t ret;
+	struct rlimit rl;
+	void *ptr;
+	long n = NOCACHE_FDS_MAX;
 
-	COND_ASSIGN_DLSYM_OR_DIE(pwrite);
-	ret = libc_pwrite(fd, buf, count, offset);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
-		NOCACHE_BUF_PERROR(buf, count, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
-	}
-	return ret;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY
+	&& rl.rlim_max < (rlim_t)n)
+		n = rl.rlim_max;
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	ptr = libc_mmap(NULL, n * sizeof *nocache_fds, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return;
+	nocache_fds = ptr;
+	nocache_nfds = n;
 }
 
-ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+/*
+ * Eviction policy rules, "policy:pattern" separated by newlines or ';'
+ * from NOCACHE_RULES and/or the file named by NOCACHE_RULES_FILE.  The
+ * first match wins; patterns with glob characters go through fnmatch(),
+ * anything else is a plain path prefix.  Only open()/openat() consult them.
+ */
+struct nocache_rule {
+	unsigned char policy;
+	unsigned char glob;
+	size_t len;
+	char *pat;
+};
+
+static const struct {
+	const char *name;
+	unsigned char policy;
+} nocache_policy_names[] = {
+	{ "behind", NOCACHE_POLICY_BEHIND },
+	{ "evict-behind", NOCACHE_POLICY_BEHIND },
+	{ "none", NOCACHE_POLICY_NONE },
+	{ "close", NOCACHE_POLICY_CLOSE },
+	{ "evict-on-close", NOCACHE_POLICY_CLOSE },
+	{ "full", NOCACHE_POLICY_FULL },
+	{ "direct", NOCACHE_POLICY_DIRECT },
+	{ "noreuse", NOCACHE_POLICY_NOREUSE },
+};
+
+/*
+ * Everything NOCACHE_CONTROL may change at runtime sits behind one pointer,
+ * so a hook pays a single load for it.  Replaced configurations are never
+ * freed since a hook may still be reading one; reloads are rare.
+ */
+struct nocache_conf {
+	unsigned char off;
+	unsigned char policy;
+	int nrules;
+	struct nocache_rule *rules;
+	size_t budget;
+};
+
+static struct nocache_conf nocache_conf_env = { 0, NOCACHE_POLICY_BEHIND, 0, NULL, 0 };
+static struct nocache_conf *nocache_conf = &nocache_conf_env;
+
+#define NOCACHE_CONF()	((const struct nocache_conf *)__atomic_load_n(&nocache_conf, __ATOMIC_ACQUIRE))
+
+static int nocache_policy_parse(const char *str, size_t len)
 {
-	ssize_t ret;
+	size_t i;
 
-	COND_ASSIGN_DLSYM_OR_DIE(readv);
-	ret = libc_readv(fd, iov, iovcnt);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
-		NOCACHE_IOV_PERROR(iov, iovcnt, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
-	}
-	return ret;
+	for (i = 0; i < sizeof nocache_policy_names / sizeof *nocache_policy_names; i++)
+		if (strlen(nocache_policy_names[i].name) == len
+		&& memcmp(nocache_policy_names[i].name, str, len) == 0)
+			return nocache_policy_names[i].policy;
+	return -1;
 }
 
-ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+static void nocache_rules_parse(struct nocache_conf *conf, char *str)
 {
-	ssize_t ret;
+	struct nocache_rule *rule;
+	char *line, *sep, *end;
+	int policy;
 
-	COND_ASSIGN_DLSYM_OR_DIE(writev);
-	ret = libc_writev(fd, iov, iovcnt);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
-		NOCACHE_IOV_PERROR(iov, iovcnt, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
+	for (line = str; line != NULL; line = end) {
+		end = strpbrk(line, ";\n");
+		if (end != NULL)
+			*end++ = '\0';
+		while (*line == ' ' || *line == '\t')
+			line++;
+		sep = strchr(line, ':');
+		if (*line == '#' || sep == NULL || sep[1] == '\0')
+			continue;
+		policy = nocache_policy_parse(line, sep - line);
+		if (policy < 0)
+			continue;
+		rule = realloc(conf->rules, (conf->nrules + 1) * sizeof *conf->rules);
+		if (rule == NULL)
+			return;
+		conf->rules = rule;
+		rule = &conf->rules[conf->nrules];
+		rule->pat = strdup(sep + 1);
+		if (rule->pat == NULL)
+			return;
+		rule->len = strlen(rule->pat);
+		rule->glob = strpbrk(rule->pat, "*?[") != NULL;
+		rule->policy = policy;
+		conf->nrules++;
 	}
-	return ret;
 }
 
-ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+/* Whole file NUL terminated in malloc()ed memory, or NULL */
+static char *nocache_file_read(const char *path)
 {
-	ssize_t ret;
+	char *buf = NULL, *ptr;
+	ssize_t len;
+	size_t size = 0;
+	int fd;
 
-	COND_ASSIGN_DLSYM_OR_DIE(preadv);
-	ret = libc_preadv(fd, iov, iovcnt, offset);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
-		NOCACHE_IOV_PERROR(iov, iovcnt, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
+	if (libc_open == NULL || libc_read == NULL || libc_close == NULL)
+		return NULL;
+	fd = libc_open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	for (;;) {
+		ptr = realloc(buf, size + NOCACHE_RULES_CHUNK + 1);
+		if (ptr == NULL)
+			break;
+		buf = ptr;
+		len = libc_read(fd, buf + size, NOCACHE_RULES_CHUNK);
+		if (len <= 0)
+			break;
+		size += len;
 	}
-	return ret;
+	libc_close(fd);
+	if (buf != NULL)
+		buf[size] = '\0';
+	return buf;
 }
 
-ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+static void nocache_rules_init(void)
 {
-	ssize_t ret;
+	struct nocache_conf *conf = &nocache_conf_env;
+	const char *str;
+	char *buf;
 
-	COND_ASSIGN_DLSYM_OR_DIE(pwritev);
-	ret = libc_pwritev(fd, iov, iovcnt, offset);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
-		NOCACHE_IOV_PERROR(iov, iovcnt, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
+	str = getenv("NOCACHE_DEFAULT");
+	if (str != NULL && nocache_policy_parse(str, strlen(str)) >= 0)
+		conf->policy = nocache_policy_parse(str, strlen(str));
+	conf->off = nocache_env_size("NOCACHE_OFF", 0) != 0;
+	str = getenv("NOCACHE_RULES");
+	if (str != NULL && (buf = strdup(str)) != NULL) {
+		nocache_rules_parse(conf, buf);
+		free(buf);
+	}
+	str = getenv("NOCACHE_RULES_FILE");
+	if (str != NULL && (buf = nocache_file_read(str)) != NULL) {
+		nocache_rules_parse(conf, buf);
+		free(buf);
 	}
-	return ret;
 }
 
-int fsync(int fd)
+static unsigned char nocache_rules_match(int fd, const char *pathname)
 {
-	int ret;
+	const struct nocache_conf *conf = NOCACHE_CONF();
+	const struct nocache_rule *rule;
+	char buf[PATH_MAX], proc[32];
+	const char *path = pathname;
+	ssize_t len;
+	size_t plen;
+	int i;
 
-	COND_ASSIGN_DLSYM_OR_DIE(fsync);
-	ret = libc_fsync(fd);
-	if (ret == 0)
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside fsync()");
-	return ret;
+	if (conf->nrules == 0)
+		return conf->policy;
+	if (*path != '/') {
+		snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+		len = readlink(proc, buf, sizeof buf - 1);
+		if (len <= 0)
+			return conf->policy;
+		buf[len] = '\0';
+		path = buf;
+	}
+	plen = strlen(path);
+	for (i = 0, rule = conf->rules; i < conf->nrules; i++, rule++) {
+		if (rule->glob) {
+			if (fnmatch(rule->pat, path, 0) == 0)
+				return rule->policy;
+		} else if (plen >= rule->len && memcmp(rule->pat, path, rule->len) == 0) {
+			return rule->policy;
+		}
+	}
+	return conf->policy;
 }
 
-#if _POSIX_SYNCHRONIZED_IO > 0
-int fdatasync(int fd)
+/* Range pool, set up once by whichever configuration first asks for a budget */
+static int nocache_budget_pool(void)
 {
-	int ret;
+	void *ptr;
+	size_t n;
+	int i;
 
-	COND_ASSIGN_DLSYM_OR_DIE(fdatasync);
-	ret = libc_fdatasync(fd);
-	if (ret == 0)
-		NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside fdatasync()");
-	return ret;
+	if (nocache_ranges != NULL)
+		return 0;
+	nocache_budget_check = nocache_env_size("NOCACHE_BUDGET_CHECK", 0) != 0;
+	n = nocache_env_size("NOCACHE_BUDGET_RANGES", NOCACHE_RANGES_DEFAULT);
+	if (n < 2 || n > INT_MAX / 2)
+		n = NOCACHE_RANGES_DEFAULT;
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	ptr = libc_mmap(NULL, (n + 1) * sizeof *nocache_ranges, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return -1;
+	nocache_nranges = n;
+	for (i = 1; i < (int)n; i++)
+		((struct nocache_range *)ptr)[i].next = i + 1;
+	nocache_range_free = 1;
+	__atomic_store_n(&nocache_ranges, ptr, __ATOMIC_RELEASE);
+	return 0;
 }
-#endif
 
-int close(int fd)
+static void nocache_age_fork(void)
 {
-	COND_ASSIGN_DLSYM_OR_DIE(close);
-	COND_CALL_SYNC(SYNC_CALL, fd, " inside close()");
-	NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside close()");
-	return libc_close(fd);
+	nocache_age_state = 0;
 }
 
-void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+static void nocache_budget_init(void)
 {
-	void *ptr;
-
-	COND_ASSIGN_DLSYM_OR_DIE(mmap);
-	ptr = libc_mmap(addr, length, prot, flags, fd, offset);
-	if (prot != PROT_NONE && ptr != MAP_FAILED
-	&& (flags & (MAP_ANON|MAP_ANONYMOUS)) == 0) {
-		if (fd >= 0)
-			NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside mmap()");
-		NOCACHE_MAP_PERROR(addr, length, NULL);
+	nocache_conf_env.budget = nocache_env_size("NOCACHE_BUDGET", 0);
+	nocache_age_ns = nocache_env_size("NOCACHE_AGE", 0) * 1000000;
+	nocache_age_files = nocache_env_size("NOCACHE_AGE_FILES", NOCACHE_AGE_FILES_DEFAULT);
+	if ((nocache_conf_env.budget != 0 || nocache_age_ns != 0) && nocache_budget_pool() != 0) {
+		nocache_conf_env.budget = 0;
+		nocache_age_ns = 0;
 	}
-	return ptr;
+	if (nocache_age_ns != 0)
+		pthread_atfork(NULL, NULL, nocache_age_fork);
 }
 
-void *mmap2(void *addr, size_t length, int prot, int flags, int fd, off_t pgoffset)
-{
-	void *ptr;
+/*
+ * Counters behind NOCACHE_STATS (dumped at exit) and NOCACHE_STATS_SHM
+ * (live in /dev/shm/<name>.<pid>).  The shared segment starts with a
+ * struct nocache_stats_hdr, then count 64-bit counters, then their names
+ * NUL separated.  Without either variable nocache_stat stays NULL.
+ */
+#define NOCACHE_STATS_LIST(X)						\
+	X(open) X(openat) X(read) X(write) X(pread) X(pwrite)		\
+	X(readv) X(writev) X(preadv) X(pwritev) X(fsync) X(fdatasync)	\
+	X(lseek) X(close) X(dup2) X(dup3) X(mmap) X(mmap2) X(msync)	\
+	X(munmap) X(mremap) X(mprotect) X(vmsplice) X(splice) X(sendfile)	\
+	X(preadv2) X(pwritev2) X(copy_file_range) X(fallocate)		\
+	X(posix_fadvise) X(madvise) X(noreuse)				\
+	X(fopen) X(freopen) X(fclose) X(stdio)				\
+	X(direct) X(direct_bounced) X(direct_fallback)			\
+	X(preserve) X(preserve_pages)					\
+	X(psi_on) X(psi_off) X(psi_skipped)				\
+	X(hot_skipped) X(aged)						\
+	X(map_cold) X(map_pageout)					\
+	X(control_reload)						\
+	X(trace_samples)						\
+	X(daemon) X(daemon_failed)					\
+	X(bytes_read) X(bytes_written) X(fadvise) X(fadvise_failed)	\
+	X(fadvise_ns) X(sync_range) X(sync_range_failed) X(sync_range_ns)	\
+	X(queued) X(queue_full) X(msync_deferred)
 
-	COND_ASSIGN_DLSYM_OR_DIE(mmap2);
-	if ((flags & MAP_FIXED) != 0)
-		NOCACHE_MAP_PERROR(addr, length, NULL);
-	ptr = libc_mmap2(addr, length, prot, flags, fd, pgoffset);
-	if (prot != PROT_NONE && ptr != MAP_FAILED
-	&& (flags & (MAP_ANON|MAP_ANONYMOUS)) == 0) {
-		if (fd >= 0)
-			NOCACHE_FD_PERROR(fd, "posix_fadvise(POSIX_FADV_DONTNEED) inside mmap2()");
-		NOCACHE_MAP_PERROR(addr, length, NULL);
-	}
-	return ptr;
-}
+#define NOCACHE_ST_ENUM(name)	NOCACHE_ST_##name,
+#define NOCACHE_ST_NAME(name)	#name,
 
-int msync(void *addr, size_t length, int flags)
+#define NOCACHE_STATS_ERRNO	64
+
+enum {
+	NOCACHE_STATS_LIST(NOCACHE_ST_ENUM)
+	NOCACHE_ST_errno,
+	NOCACHE_ST_MAX = NOCACHE_ST_errno + NOCACHE_STATS_ERRNO
+};
+
+static const char *const nocache_stat_names[] = {
+	NOCACHE_STATS_LIST(NOCACHE_ST_NAME)
+};
+
+#define NOCACHE_STATS_MAGIC	"NOCACHE1"
+#define NOCACHE_STATS_NAMES	(NOCACHE_ST_MAX * 20)
+
+struct nocache_stats_hdr {
+	char magic[8];
+	uint32_t count;
+	uint32_t names;
+	uint64_t pid;
+};
+
+struct nocache_stats_shm {
+	struct nocache_stats_hdr hdr;
+	uint64_t v[NOCACHE_ST_MAX];
+	char names[NOCACHE_STATS_NAMES];
+};
+
+static uint64_t *nocache_stat = NULL;
+static struct nocache_stats_shm *nocache_stats_seg = NULL;
+static char nocache_stats_shm[NAME_MAX];
+static const char *nocache_stats_out = NULL;
+static int nocache_stats_fd = -1;
+
+#define NOCACHE_STAT(name, n)						\
+	do {								\
+		if (nocache_stat != NULL)				\
+			__atomic_add_fetch(&nocache_stat[NOCACHE_ST_##name], n, __ATOMIC_RELAXED);	\
+	} while (0)
+
+static uint64_t nocache_now(void)
 {
-	int ret;
+	struct timespec ts;
 
-	COND_ASSIGN_DLSYM_OR_DIE(munmap);
-	ret = libc_msync(addr, length, (flags & ~MS_ASYNC) | MS_SYNC);
-	if (ret == 0)
-		NOCACHE_MAP_PERROR(addr, length, "madvise(MADV_DONTNEED) inside msync()");
-	return ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-int munmap(void *addr, size_t length)
+static void nocache_stat_err(int error)
 {
-	COND_ASSIGN_DLSYM_OR_DIE(munmap);
-	NOCACHE_MAP_PERROR(addr, length, "madvise(MADV_DONTNEED) inside munmap()");
-	return libc_munmap(addr, length);
+	if (error < 0 || error >= NOCACHE_STATS_ERRNO)
+		error = 0;
+	__atomic_add_fetch(&nocache_stat[NOCACHE_ST_errno + error], 1, __ATOMIC_RELAXED);
 }
 
-ssize_t vmsplice(int fd, const struct iovec *iov, unsigned long nr_segs, unsigned int flags)
+static int nocache_fadvise(int fd, off_t off, off_t len, int advice)
 {
-	ssize_t ret;
+	uint64_t t;
+	int ret;
 
-	COND_ASSIGN_DLSYM_OR_DIE(vmsplice);
-	ret = libc_vmsplice(fd, iov, nr_segs, flags);
-	if (ret > 0)
-		NOCACHE_IOV_PERROR(iov, nr_segs, NULL);
+	COND_ASSIGN_DLSYM64_OR_DIE(posix_fadvise, posix_fadvise64);
+	if (nocache_stat == NULL)
+		return libc_posix_fadvise(fd, off, len, advice);
+	t = nocache_now();
+	ret = libc_posix_fadvise(fd, off, len, advice);
+	NOCACHE_STAT(fadvise_ns, nocache_now() - t);
+	NOCACHE_STAT(fadvise, 1);
+	if (ret != 0) {
+		NOCACHE_STAT(fadvise_failed, 1);
+		nocache_stat_err(ret);
+	}
 	return ret;
 }
 
-ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags)
+static int nocache_sync_range(int fd, off_t off, off_t len, unsigned int flags)
 {
-	ssize_t ret;
+	uint64_t t;
+	int ret;
 
-	COND_ASSIGN_DLSYM_OR_DIE(splice);
-	ret = libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
-	if (ret > 0 && posix_fadvise(fd_in, 0, 0, POSIX_FADV_DONTNEED) != 9) {
-		NOCACHE_FD_PERROR(fd_in, NULL);
-		NOCACHE_FD_PERROR(fd_out, NULL);
+	if (nocache_stat == NULL)
+		return sync_file_range(fd, off, len, flags);
+	t = nocache_now();
+	ret = sync_file_range(fd, off, len, flags);
+	NOCACHE_STAT(sync_range_ns, nocache_now() - t);
+	NOCACHE_STAT(sync_range, 1);
+	if (ret != 0) {
+		NOCACHE_STAT(sync_range_failed, 1);
+		nocache_stat_err(errno);
 	}
 	return ret;
 }
 
-ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+static int nocache_stats_map(void)
 {
-	size_t ret;
+	struct nocache_stats_shm *seg;
+	char *p;
+	int fd, i;
 
-	COND_ASSIGN_DLSYM_OR_DIE(sendfile);
-	ret = libc_sendfile(out_fd, in_fd, offset, count);
-	if (ret > 0) {
-		NOCACHE_FD_PERROR(in_fd, NULL);
-		NOCACHE_FD_PERROR(out_fd, NULL);
+	snprintf(nocache_stats_shm, sizeof nocache_stats_shm, "/%s.%ld",
+		getenv("NOCACHE_STATS_SHM"), (long)getpid());
+	fd = shm_open(nocache_stats_shm, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, sizeof *seg) != 0) {
+		libc_close(fd);
+		shm_unlink(nocache_stats_shm);
+		return -1;
 	}
-	return ret;
-}
+	seg = libc_mmap(NULL, sizeof *seg, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	libc_close(fd);
+	if (seg == MAP_FAILED) {
+		shm_unlink(nocache_stats_shm);
+		return -1;
+	}
+	p = seg->names;
+	for (i = 0; i < NOCACHE_ST_MAX; i++) {
+		if (i < NOCACHE_ST_errno)
+			p += snprintf(p, seg->names + sizeof seg->names - p, "%s", nocache_stat_names[i]);
+		else
+			p += snprintf(p, seg->names + sizeof seg->names - p, "errno.%d", i - NOCACHE_ST_errno);
+		p++;
+	}
+	seg->hdr.count = NOCACHE_ST_MAX;
+	seg->hdr.names = seg->names - (char *)seg;
+	seg->hdr.pid = getpid();
+	memcpy(seg->hdr.magic, NOCACHE_STATS_MAGIC, sizeof seg->hdr.magic);
+	nocache_stats_seg = seg;
+	nocache_stat = seg->v;
+	return 0;
+}
+
+/* A child starts counting from zero, in its own segment when shared */
+static void nocache_stats_fork(void)
+{
+	if (nocache_stats_seg != NULL) {
+		libc_munmap(nocache_stats_seg, sizeof *nocache_stats_seg);
+		nocache_stats_seg = NULL;
+		nocache_stat = NULL;
+		if (nocache_stats_map() == 0)
+			return;
+	}
+	if (nocache_stats_out == NULL)
+		return;
+	if (nocache_stat == NULL) {
+		nocache_stat = libc_mmap(NULL, NOCACHE_ST_MAX * sizeof *nocache_stat, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (nocache_stat == MAP_FAILED)
+			nocache_stat = NULL;
+	} else {
+		memset(nocache_stat, 0, NOCACHE_ST_MAX * sizeof *nocache_stat);
+	}
+}
+
+static void nocache_stats_init(void)
+{
+	const char *str;
+	char *ep;
+	long fd;
+
+	str = getenv("NOCACHE_STATS");
+	if (str != NULL && *str != '\0') {
+		nocache_stats_out = str;
+		fd = strtol(str, &ep, 10);
+		/* Own copy of a numbered descriptor, programs like dd close stderr before exit */
+		if (*ep == '\0' && (fd < 0 || fd > INT_MAX || (nocache_stats_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0))
+			nocache_stats_out = NULL;
+	}
+	str = getenv("NOCACHE_STATS_SHM");
+	if (str != NULL && (*str == '\0' || strchr(str, '/') != NULL))
+		str = NULL;
+	if (str == NULL && nocache_stats_out == NULL)
+		return;
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	if (str == NULL || nocache_stats_map() != 0)
+		nocache_stats_fork();
+	pthread_atfork(NULL, NULL, nocache_stats_fork);
+}
+
+/* One line of name=value pairs per process, written with a single write() so appends stay whole */
+static void nocache_stats_dump(void)
+{
+	char buf[8192];
+	size_t len;
+	int fd = nocache_stats_fd, i;
+
+	if (nocache_stat == NULL || nocache_stats_out == NULL)
+		return;
+	len = snprintf(buf, sizeof buf, "nocache pid=%ld", (long)getpid());
+	for (i = 0; i < NOCACHE_ST_MAX && len < sizeof buf; i++) {
+		if (nocache_stat[i] == 0)
+			continue;
+		if (i < NOCACHE_ST_errno)
+			len += snprintf(buf + len, sizeof buf - len, " %s=%llu",
+				nocache_stat_names[i], (unsigned long long)nocache_stat[i]);
+		else
+			len += snprintf(buf + len, sizeof buf - len, " errno.%d=%llu",
+				i - NOCACHE_ST_errno, (unsigned long long)nocache_stat[i]);
+	}
+	if (len >= sizeof buf)
+		len = sizeof buf - 1;
+	buf[len++] = '\n';
+	if (fd < 0) {
+		fd = libc_open(nocache_stats_out, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+		if (fd < 0)
+			return;
+	}
+	if (libc_write(fd, buf, len) < 0)
+		DEBUG_PERROR("write() of NOCACHE_STATS");
+	if (fd != nocache_stats_fd)
+		libc_close(fd);
+}
+
+/* Running kernel is at least major.minor */
+static int nocache_kernel_at_least(int major, int minor)
+{
+	struct utsname u;
+	int ma, mi;
+
+	if (uname(&u) != 0 || sscanf(u.release, "%d.%d", &ma, &mi) != 2)
+		return 0;
+	return ma > major || (ma == major && mi >= minor);
+}
+
+static void nocache_map_cold_fork(void)
+{
+	nocache_map_cold_state = 0;
+}
+
+static void nocache_maps_init(void)
+{
+	void *ptr;
+	size_t n;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (pagesize > 0)
+		nocache_pagemask = pagesize - 1;
+	n = nocache_env_size("NOCACHE_MAPS", NOCACHE_MAPS_DEFAULT);
+	if (n == 0 || n > INT_MAX / 2)
+		return;
+	ptr = libc_mmap(NULL, n * sizeof *nocache_maps, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return;
+	nocache_maps = ptr;
+	nocache_maps_max = n;
+	/* MADV_COLD and MADV_PAGEOUT came with Linux 5.4, the mincore() vector assumes pages of 4k or more */
+	if (nocache_kernel_at_least(5, 4) && nocache_pagemask >= 4095)
+		nocache_map_cold_ms = nocache_env_size("NOCACHE_MAP_COLD", 0);
+	if (nocache_map_cold_ms != 0)
+		pthread_atfork(NULL, NULL, nocache_map_cold_fork);
+}
+
+static void nocache_direct_free(void *buf)
+{
+	libc_munmap(buf, nocache_direct_chunk);
+}
+
+/* Also run for each reloaded configuration, direct mode cannot be turned off again */
+static void nocache_direct_init(const struct nocache_conf *conf)
+{
+	size_t n;
+	int i, want;
+
+	want = conf->policy == NOCACHE_POLICY_DIRECT;
+	for (i = 0; i < conf->nrules; i++)
+		if (conf->rules[i].policy == NOCACHE_POLICY_DIRECT)
+			want = 1;
+	if (!want || nocache_direct)
+		return;
+	nocache_direct_min = nocache_env_size("NOCACHE_DIRECT_MIN", NOCACHE_DIRECT_MIN_DEFAULT);
+	n = nocache_env_size("NOCACHE_DIRECT_CHUNK", NOCACHE_DIRECT_CHUNK_DEFAULT);
+	n = (n + nocache_pagemask) & ~(size_t)nocache_pagemask;
+	nocache_direct_chunk = n != 0 ? n : NOCACHE_DIRECT_CHUNK_DEFAULT;
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	if (pthread_key_create(&nocache_direct_key, nocache_direct_free) == 0)
+		__atomic_store_n(&nocache_direct, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pressure mode: DONTNEED only runs while the "some" avg10 of the PSI file
+ * is at least NOCACHE_PSI percent, and stops once it drops to NOCACHE_PSI_LOW.
+ * A helper thread rereads the file every NOCACHE_PSI_INTERVAL ms and, on a
+ * real /proc/pressure file, also waits on a kernel trigger so eviction comes
+ * back as soon as stalls start rather than when the average catches up.
+ */
+/* "some" avg10 in hundredths of a percent, -1 when unreadable */
+static long nocache_psi_read(void)
+{
+	char buf[256], *p;
+	ssize_t n;
+	long v = 0, frac = 0, scale = 10;
+
+	n = libc_pread(nocache_psi_fd, buf, sizeof buf - 1, 0);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	for (p = buf; p != NULL && strncmp(p, "some ", 5) != 0; )
+		if ((p = strchr(p, '\n')) != NULL)
+			p++;
+	if (p == NULL || (p = strstr(p, "avg10=")) == NULL)
+		return -1;
+	for (p += 6; *p >= '0' && *p <= '9'; p++)
+		v = v * 10 + *p - '0';
+	if (*p == '.')
+		for (p++; scale > 0 && *p >= '0' && *p <= '9'; p++, scale /= 10)
+			frac += (*p - '0') * scale;
+	return v * 100 + frac;
+}
+
+static void nocache_psi_update(int hold)
+{
+	long v = nocache_psi_read();
+	int on = __atomic_load_n(&nocache_psi_on, __ATOMIC_RELAXED);
+
+	if (!on && (hold || (v >= 0 && (unsigned long)v >= nocache_psi_high))) {
+		__atomic_store_n(&nocache_psi_on, 1, __ATOMIC_RELAXED);
+		NOCACHE_STAT(psi_on, 1);
+	} else if (on && !hold && v >= 0 && (unsigned long)v <= nocache_psi_low) {
+		__atomic_store_n(&nocache_psi_on, 0, __ATOMIC_RELAXED);
+		NOCACHE_STAT(psi_off, 1);
+	}
+}
+
+static void *nocache_psi_thread(void *arg)
+{
+	struct pollfd pfd;
+	size_t hold = 0;
+	int ret;
+
+	(void)arg;
+	for (;;) {
+		pfd.fd = nocache_psi_tfd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		ret = poll(&pfd, nocache_psi_tfd >= 0, nocache_psi_ms);
+		if (ret > 0 && (pfd.revents & (POLLERR|POLLNVAL)) != 0) {
+			libc_close(nocache_psi_tfd);
+			nocache_psi_tfd = -1;
+		} else if (ret > 0) {
+			/* avg10 lags the trigger, keep evicting until it has had time to catch up */
+			hold = NOCACHE_PSI_HOLD / nocache_psi_ms + 1;
+		}
+		nocache_psi_update(hold != 0);
+		if (hold != 0)
+			hold--;
+	}
+	return NULL;
+}
+
+static void nocache_psi_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	int state = 0, ret;
+
+	if (!__atomic_compare_exchange_n(&nocache_psi_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&tid, &attr, nocache_psi_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+		__atomic_store_n(&nocache_psi_on, 1, __ATOMIC_RELAXED);
+}
+
+static void nocache_psi_fork(void)
+{
+	nocache_psi_state = 0;
+}
+
+/* Whether eviction is wanted right now; the helper thread starts with the first question */
+static int nocache_psi_evict(void)
+{
+	if (nocache_psi_fd < 0)
+		return 1;
+	if (__atomic_load_n(&nocache_psi_state, __ATOMIC_RELAXED) == 0)
+		nocache_psi_start();
+	return __atomic_load_n(&nocache_psi_on, __ATOMIC_RELAXED);
+}
+
+/*
+ * NOCACHE_CONTROL names a file of NOCACHE_OFF, NOCACHE_DEFAULT, NOCACHE_RULES
+ * and NOCACHE_BUDGET assignments, shell style, that override the environment
+ * of a running process.  A helper thread stats it every NOCACHE_CONTROL_INTERVAL
+ * ms and publishes a new configuration when it changes; removing the file
+ * goes back to the environment.  Rules and the default policy apply to
+ * descriptors opened afterwards.
+ */
+static struct nocache_conf *nocache_control_parse(char *buf)
+{
+	struct nocache_conf *conf;
+	char *line, *end, *val;
+	size_t len;
+	int policy, rules = 0;
+
+	conf = malloc(sizeof *conf);
+	if (conf == NULL)
+		return NULL;
+	*conf = nocache_conf_env;
+	for (line = buf; line != NULL; line = end) {
+		end = strchr(line, '\n');
+		if (end != NULL)
+			*end++ = '\0';
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if (strncmp(line, "export ", 7) == 0)
+			line += 7;
+		val = strchr(line, '=');
+		if (*line == '#' || val == NULL)
+			continue;
+		*val++ = '\0';
+		len = strlen(val);
+		if (len >= 2 && (*val == '"' || *val == '\'') && val[len - 1] == *val) {
+			val[len - 1] = '\0';
+			val++;
+		}
+		if (strcmp(line, "NOCACHE_OFF") == 0) {
+			conf->off = nocache_size_parse(val, 0) != 0;
+		} else if (strcmp(line, "NOCACHE_DEFAULT") == 0) {
+			if ((policy = nocache_policy_parse(val, strlen(val))) >= 0)
+				conf->policy = policy;
+		} else if (strcmp(line, "NOCACHE_RULES") == 0) {
+			/* Replaces the environment's rules, further lines add to them */
+			if (!rules) {
+				conf->rules = NULL;
+				conf->nrules = 0;
+				rules = 1;
+			}
+			nocache_rules_parse(conf, val);
+		} else if (strcmp(line, "NOCACHE_BUDGET") == 0) {
+			conf->budget = nocache_size_parse(val, 0);
+		}
+	}
+	return conf;
+}
+
+static void nocache_control_set(struct nocache_conf *conf)
+{
+	const struct nocache_conf *old = nocache_conf;
+	int fd, hi;
+
+	if (conf->budget != 0 && nocache_budget_pool() != 0)
+		conf->budget = 0;
+	nocache_direct_init(conf);
+	/* Nothing was tracked while off, positions recorded before then are stale */
+	if (old->off && !conf->off) {
+		hi = __atomic_load_n(&nocache_fdhi, __ATOMIC_RELAXED);
+		for (fd = 0; fd <= hi && fd < nocache_nfds; fd++)
+			__atomic_and_fetch(&nocache_fds[fd].flags, ~NOCACHE_FD_POS, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&nocache_conf, conf, __ATOMIC_RELEASE);
+	NOCACHE_STAT(control_reload, 1);
+}
+
+static void nocache_control_check(void)
+{
+	struct nocache_conf *conf;
+	struct stat st;
+	char *buf;
+
+	if (stat(nocache_control_path, &st) != 0) {
+		if (nocache_control_seen) {
+			nocache_control_seen = 0;
+			nocache_control_set(&nocache_conf_env);
+		}
+		return;
+	}
+	if (nocache_control_seen && st.st_dev == nocache_control_st.st_dev
+	&& st.st_ino == nocache_control_st.st_ino && st.st_size == nocache_control_st.st_size
+	&& st.st_mtim.tv_sec == nocache_control_st.st_mtim.tv_sec
+	&& st.st_mtim.tv_nsec == nocache_control_st.st_mtim.tv_nsec)
+		return;
+	nocache_control_st = st;
+	nocache_control_seen = 1;
+	buf = nocache_file_read(nocache_control_path);
+	if (buf == NULL)
+		return;
+	conf = nocache_control_parse(buf);
+	free(buf);
+	if (conf != NULL)
+		nocache_control_set(conf);
+}
+
+static void *nocache_control_thread(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	ts.tv_sec = nocache_control_ms / 1000;
+	ts.tv_nsec = (nocache_control_ms % 1000) * 1000000;
+	for (;;) {
+		nanosleep(&ts, NULL);
+		nocache_control_check();
+	}
+	return NULL;
+}
+
+static void nocache_control_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	int state = 0;
+
+	if (nocache_control_path == NULL
+	|| __atomic_load_n(&nocache_control_state, __ATOMIC_RELAXED) != 0
+	|| !__atomic_compare_exchange_n(&nocache_control_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&tid, &attr, nocache_control_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void nocache_control_fork(void)
+{
+	nocache_control_state = 0;
+}
+
+static void nocache_control_init(void)
+{
+	const char *path = getenv("NOCACHE_CONTROL");
+
+	if (path == NULL || *path == '\0' || (nocache_control_path = strdup(path)) == NULL)
+		return;
+	nocache_control_ms = nocache_env_size("NOCACHE_CONTROL_INTERVAL", NOCACHE_CONTROL_INTERVAL_DEFAULT);
+	if (nocache_control_ms == 0)
+		nocache_control_ms = NOCACHE_CONTROL_INTERVAL_DEFAULT;
+	COND_ASSIGN_DLSYM64_OR_DIE(open, open64);
+	COND_ASSIGN_DLSYM_OR_DIE(read);
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	nocache_control_check();
+	pthread_atfork(NULL, NULL, nocache_control_fork);
+}
+
+/*
+ * Tracing: every NOCACHE_TRACE_INTERVAL ms a helper thread samples the cached
+ * and dirty page counts of up to NOCACHE_TRACE_FILES open files, resuming
+ * where the previous tick stopped, and appends them to NOCACHE_TRACE for
+ * nocachetrace to print.  Without cachestat() residency comes from mincore()
+ * and the dirty count is unknown (all ones).
+ */
+static uint64_t nocache_trace_mincore(int fd, off_t size)
+{
+	unsigned char vec[NOCACHE_TRACE_VEC];
+	char *map;
+	size_t npages, i, j, n;
+	uint64_t cached = 0;
+	int shift = __builtin_ctzl(nocache_pagemask + 1);
+
+	if (size <= 0)
+		return UINT64_MAX;
+	npages = ((uint64_t)size + nocache_pagemask) >> shift;
+	map = libc_mmap(NULL, npages << shift, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return UINT64_MAX;
+	for (i = 0; i < npages; i += n) {
+		n = npages - i < NOCACHE_TRACE_VEC ? npages - i : NOCACHE_TRACE_VEC;
+		if (mincore(map + (i << shift), n << shift, vec) != 0)
+			break;
+		for (j = 0; j < n; j++)
+			cached += vec[j] & 1;
+	}
+	libc_munmap(map, npages << shift);
+	return i < npages ? UINT64_MAX : cached;
+}
+
+static void nocache_trace_flush(struct nocache_trace_rec *rec, int n)
+{
+	if (n != 0 && libc_write(nocache_trace_fd, rec, n * sizeof *rec) != (ssize_t)(n * sizeof *rec))
+		DEBUG_PERROR("write() of NOCACHE_TRACE");
+}
+
+static void nocache_trace_tick(void)
+{
+	struct nocache_trace_rec rec[NOCACHE_TRACE_BATCH], *r;
+	struct nocache_cachestat_range csr = { 0, 0 };
+	struct nocache_cachestat cs;
+	struct nocache_fd *nf;
+	struct timespec ts;
+	struct stat st;
+	size_t taken = 0;
+	int fd, hi, i, j, n = 0;
+
+	hi = __atomic_load_n(&nocache_fdhi, __ATOMIC_RELAXED);
+	if (hi >= nocache_nfds)
+		hi = nocache_nfds - 1;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fd = nocache_trace_next <= hi ? nocache_trace_next : 0;
+	for (i = 0; i <= hi && taken < nocache_trace_files; i++, fd = fd < hi ? fd + 1 : 0) {
+		nf = &nocache_fds[fd];
+		/* Evicted, left alone by policy or duplicated for a mapping, but not sockets and pipes */
+		if ((__atomic_load_n(&nf->flags, __ATOMIC_ACQUIRE) & NOCACHE_FD_SEEN) == 0 || nf->ino == 0)
+			continue;
+		/* The number may have been closed and reused since, so only trust a matching inode */
+		if (fstat(fd, &st) != 0 || st.st_dev != nf->dev || st.st_ino != nf->ino)
+			continue;
+		for (j = 0; j < n && (rec[j].dev != st.st_dev || rec[j].ino != st.st_ino); j++)
+			;
+		if (j < n)
+			continue;
+		r = &rec[n];
+		r->dirty = UINT64_MAX;
+		if (nocache_trace_cachestat && syscall(__NR_cachestat, fd, &csr, &cs, 0) == 0) {
+			r->cached = cs.nr_cache;
+			r->dirty = cs.nr_dirty;
+		} else {
+			if (errno == ENOSYS)
+				nocache_trace_cachestat = 0;
+			r->cached = nocache_trace_mincore(fd, st.st_size);
+			if (r->cached == UINT64_MAX)
+				continue;
+		}
+		r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		r->dev = st.st_dev;
+		r->ino = st.st_ino;
+		r->pid = getpid();
+		r->pagesize = nocache_pagemask + 1;
+		taken++;
+		if (++n == NOCACHE_TRACE_BATCH) {
+			nocache_trace_flush(rec, n);
+			n = 0;
+		}
+	}
+	nocache_trace_next = fd;
+	nocache_trace_flush(rec, n);
+	NOCACHE_STAT(trace_samples, taken);
+}
+
+static void *nocache_trace_thread(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	ts.tv_sec = nocache_trace_ms / 1000;
+	ts.tv_nsec = (nocache_trace_ms % 1000) * 1000000;
+	for (;;) {
+		nocache_trace_tick();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static void nocache_trace_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	int state = 0;
+
+	if (nocache_trace_fd < 0
+	|| __atomic_load_n(&nocache_trace_state, __ATOMIC_RELAXED) != 0
+	|| !__atomic_compare_exchange_n(&nocache_trace_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&tid, &attr, nocache_trace_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void nocache_trace_fork(void)
+{
+	nocache_trace_state = 0;
+}
+
+static void nocache_trace_init(void)
+{
+	const char *path = getenv("NOCACHE_TRACE");
+	struct nocache_trace_rec hdr;
+	struct stat st;
+
+	if (path == NULL || *path == '\0')
+		return;
+	nocache_trace_ms = nocache_env_size("NOCACHE_TRACE_INTERVAL", NOCACHE_TRACE_INTERVAL_DEFAULT);
+	if (nocache_trace_ms == 0)
+		nocache_trace_ms = NOCACHE_TRACE_INTERVAL_DEFAULT;
+	nocache_trace_files = nocache_env_size("NOCACHE_TRACE_FILES", NOCACHE_TRACE_FILES_DEFAULT);
+	if (nocache_trace_files == 0)
+		return;
+	COND_ASSIGN_DLSYM64_OR_DIE(open, open64);
+	COND_ASSIGN_DLSYM_OR_DIE(write);
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	nocache_trace_fd = libc_open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if (nocache_trace_fd < 0)
+		return;
+	if (fstat(nocache_trace_fd, &st) == 0 && st.st_size == 0) {
+		memset(&hdr, 0, sizeof hdr);
+		memcpy(&hdr.ns, NOCACHE_TRACE_MAGIC, sizeof hdr.ns);
+		hdr.dev = sizeof hdr;
+		nocache_trace_flush(&hdr, 1);
+	}
+	pthread_atfork(NULL, NULL, nocache_trace_fork);
+}
+
+static void nocache_hot_init(void)
+{
+	const char *name = getenv("NOCACHE_HOT_SHM");
+	char path[NAME_MAX];
+	struct nocache_hot *hot;
+	struct stat st;
+	size_t w, size;
+	uint32_t state = 0;
+	int fd = -1;
+
+	nocache_hot_min = nocache_env_size("NOCACHE_HOT", 0);
+	if (nocache_hot_min == 0)
+		return;
+	for (w = NOCACHE_HOT_WIDTH_DEFAULT; w < nocache_env_size("NOCACHE_HOT_WIDTH", NOCACHE_HOT_WIDTH_DEFAULT); w <<= 1)
+		;
+	if (w > (1ul << 24))
+		w = 1ul << 24;
+	nocache_hot_decay = nocache_env_size("NOCACHE_HOT_DECAY", 16 * w);
+	if (nocache_hot_decay == 0)
+		nocache_hot_decay = 16 * w;
+	size = sizeof *hot + NOCACHE_HOT_DEPTH * w * sizeof hot->count[0];
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	if (name != NULL && *name != '\0') {
+		snprintf(path, sizeof path, "/%s", name);
+		fd = shm_open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+		if (fd < 0)
+			return;
+		/* Growing only, so a larger sketch created by another process stays intact */
+		if (fstat(fd, &st) != 0 || (st.st_size < (off_t)size && ftruncate(fd, size) != 0)) {
+			libc_close(fd);
+			return;
+		}
+		hot = libc_mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		libc_close(fd);
+	} else {
+		hot = libc_mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	if (hot == MAP_FAILED)
+		return;
+	if (__atomic_compare_exchange_n(&hot->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		hot->width = w;
+		memcpy(hot->magic, NOCACHE_HOT_MAGIC, sizeof hot->magic);
+		__atomic_store_n(&hot->state, 2, __ATOMIC_RELEASE);
+	} else {
+		while (__atomic_load_n(&hot->state, __ATOMIC_ACQUIRE) != 2)
+			sched_yield();
+	}
+	/* The first process sized a shared sketch, and only a smaller one fits this mapping */
+	if (memcmp(hot->magic, NOCACHE_HOT_MAGIC, sizeof hot->magic) != 0 || hot->width > w) {
+		libc_munmap(hot, size);
+		return;
+	}
+	nocache_hot = hot;
+}
+
+static void nocache_psi_init(void)
+{
+	const char *env = getenv("NOCACHE_PSI"), *path;
+	char *end, trig[64];
+	double d;
+	long v;
+
+	if (env == NULL || (d = strtod(env, &end)) <= 0 || end == env)
+		return;
+	nocache_psi_high = d * 100;
+	env = getenv("NOCACHE_PSI_LOW");
+	nocache_psi_low = nocache_psi_high / 2;
+	if (env != NULL && (d = strtod(env, &end)) >= 0 && end != env)
+		nocache_psi_low = d * 100;
+	nocache_psi_ms = nocache_env_size("NOCACHE_PSI_INTERVAL", NOCACHE_PSI_INTERVAL_DEFAULT);
+	if (nocache_psi_ms == 0 || nocache_psi_ms > INT_MAX)
+		nocache_psi_ms = NOCACHE_PSI_INTERVAL_DEFAULT;
+	path = getenv("NOCACHE_PSI_PATH");
+	if (path == NULL || *path == '\0')
+		path = NOCACHE_PSI_PATH_DEFAULT;
+	COND_ASSIGN_DLSYM64_OR_DIE(open, open64);
+	COND_ASSIGN_DLSYM64_OR_DIE(pread, pread64);
+	COND_ASSIGN_DLSYM_OR_DIE(write);
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	nocache_psi_fd = libc_open(path, O_RDONLY|O_CLOEXEC, 0);
+	if (nocache_psi_fd < 0)
+		return;
+	if (strncmp(path, "/proc/pressure/", 15) == 0 && nocache_psi_high < 10000) {
+		snprintf(trig, sizeof trig, "some %lu %u",
+			(unsigned long)((uint64_t)NOCACHE_PSI_WINDOW * nocache_psi_high / 10000), NOCACHE_PSI_WINDOW);
+		nocache_psi_tfd = libc_open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC, 0);
+		if (nocache_psi_tfd >= 0 && libc_write(nocache_psi_tfd, trig, strlen(trig) + 1) < 0) {
+			libc_close(nocache_psi_tfd);
+			nocache_psi_tfd = -1;
+		}
+	}
+	v = nocache_psi_read();
+	nocache_psi_on = v < 0 || (unsigned long)v >= nocache_psi_high;
+	pthread_atfork(NULL, NULL, nocache_psi_fork);
+}
+
+/*
+ * The helper threads walk the mappings, the budget records and the sync batch
+ * under these mutexes.  fork() waits for them, taken in the order they nest,
+ * so none is left held for good in a child that has only the forking thread.
+ */
+static void nocache_locks_take(void)
+{
+	pthread_mutex_lock(&nocache_sync_flush_lock);
+	pthread_mutex_lock(&nocache_sync_lock);
+	pthread_mutex_lock(&nocache_maps_lock);
+	pthread_mutex_lock(&nocache_budget_lock);
+}
+
+static void nocache_locks_give(void)
+{
+	pthread_mutex_unlock(&nocache_budget_lock);
+	pthread_mutex_unlock(&nocache_maps_lock);
+	pthread_mutex_unlock(&nocache_sync_lock);
+	pthread_mutex_unlock(&nocache_sync_flush_lock);
+}
+
+static void nocache_locks_fork(void)
+{
+	pthread_mutex_init(&nocache_budget_lock, NULL);
+	pthread_mutex_init(&nocache_maps_lock, NULL);
+	pthread_mutex_init(&nocache_sync_lock, NULL);
+	pthread_mutex_init(&nocache_sync_flush_lock, NULL);
+}
+
+void __attribute__((constructor)) nocache_init(void)
+{
+	int error = errno;
+	size_t n;
+
+	ASSIGN_DLSYM64_IF_EXIST(open, open64);
+	ASSIGN_DLSYM64_IF_EXIST(openat, openat64);
+	ASSIGN_DLSYM_IF_EXIST(read);
+	ASSIGN_DLSYM_IF_EXIST(write);
+	ASSIGN_DLSYM64_IF_EXIST(pread, pread64);
+	ASSIGN_DLSYM64_IF_EXIST(pwrite, pwrite64);
+	ASSIGN_DLSYM_IF_EXIST(readv);
+	ASSIGN_DLSYM_IF_EXIST(writev);
+	ASSIGN_DLSYM64_IF_EXIST(preadv, preadv64);
+	ASSIGN_DLSYM64_IF_EXIST(pwritev, pwritev64);
+	ASSIGN_DLSYM_IF_EXIST(fsync);
+#if _POSIX_SYNCHRONIZED_IO > 0
+	ASSIGN_DLSYM_IF_EXIST(fdatasync);
+#endif
+	ASSIGN_DLSYM_IF_EXIST(close);
+	ASSIGN_DLSYM_IF_EXIST(dup2);
+	ASSIGN_DLSYM_IF_EXIST(dup3);
+	ASSIGN_DLSYM64_IF_EXIST(mmap, mmap64);
+	ASSIGN_DLSYM_IF_EXIST(mmap2);
+	ASSIGN_DLSYM_IF_EXIST(msync);
+	ASSIGN_DLSYM_IF_EXIST(munmap);
+	ASSIGN_DLSYM_IF_EXIST(mremap);
+	ASSIGN_DLSYM_IF_EXIST(mprotect);
+	ASSIGN_DLSYM_IF_EXIST(madvise);
+	ASSIGN_DLSYM64_IF_EXIST(posix_fadvise, posix_fadvise64);
+	ASSIGN_DLSYM_IF_EXIST(vmsplice);
+	ASSIGN_DLSYM_IF_EXIST(splice);
+	ASSIGN_DLSYM64_IF_EXIST(sendfile, sendfile64);
+	ASSIGN_DLSYM64_IF_EXIST(preadv2, preadv64v2);
+	ASSIGN_DLSYM64_IF_EXIST(pwritev2, pwritev64v2);
+	ASSIGN_DLSYM_IF_EXIST(copy_file_range);
+	ASSIGN_DLSYM64_IF_EXIST(fallocate, fallocate64);
+	ASSIGN_DLSYM64_IF_EXIST(fopen, fopen64);
+	ASSIGN_DLSYM64_IF_EXIST(freopen, freopen64);
+	ASSIGN_DLSYM_IF_EXIST(fclose);
+	ASSIGN_DLSYM_IF_EXIST(fread);
+	ASSIGN_DLSYM_IF_EXIST(fwrite);
+	ASSIGN_DLSYM_IF_EXIST(fread_unlocked);
+	ASSIGN_DLSYM_IF_EXIST(fwrite_unlocked);
+	ASSIGN_DLSYM_IF_EXIST(fgets);
+	ASSIGN_DLSYM_IF_EXIST(fgets_unlocked);
+	ASSIGN_DLSYM_IF_EXIST(fputs);
+	ASSIGN_DLSYM_IF_EXIST(fputs_unlocked);
+	ASSIGN_DLSYM_IF_EXIST(getline);
+	ASSIGN_DLSYM_IF_EXIST(getdelim);
+	ASSIGN_DLSYM_IF_EXIST(vfprintf);
+	ASSIGN_DLSYM64_IF_EXIST(lseek, lseek64);
+
+	nocache_batch = nocache_env_size("NOCACHE_BATCH", NOCACHE_BATCH_DEFAULT);
+	nocache_ahead = nocache_env_size("NOCACHE_AHEAD", 0);
+	nocache_behind = nocache_env_size("NOCACHE_BEHIND", NOCACHE_BEHIND_DEFAULT);
+	nocache_step = nocache_ahead / 2 < nocache_batch ? nocache_ahead / 2 : nocache_batch;
+	nocache_wbehind = nocache_env_size("NOCACHE_WRITEBEHIND", 0);
+	nocache_preserve = nocache_env_size("NOCACHE_PRESERVE", 0) != 0;
+	nocache_noreuse = nocache_kernel_at_least(6, 3);
+	if (getenv("NOCACHE_DAEMON") != NULL && *getenv("NOCACHE_DAEMON") != '\0')
+		nocache_daemon_path = strdup(getenv("NOCACHE_DAEMON"));
+#ifdef FORCE_SYNC
+	nocache_sync_ms = nocache_env_size("NOCACHE_SYNC_WINDOW", NOCACHE_SYNC_WINDOW_DEFAULT);
+	n = nocache_env_size("NOCACHE_SYNC_FILES", NOCACHE_SYNC_FILES_DEFAULT);
+	if (nocache_sync_ms != 0 && n <= INT_MAX / 2)
+		nocache_syncs_max = n;
+#endif
+	n = nocache_env_size("NOCACHE_ALIGN", NOCACHE_ALIGN_DEFAULT);
+	nocache_align = (n & (n - 1)) == 0 && n != 0 ? n - 1 : 0;
+	n = nocache_env_size("NOCACHE_WORKER", 0);
+	if (n != 0) {
+		for (nocache_qmask = NOCACHE_WORKER_BATCH; nocache_qmask < n; nocache_qmask <<= 1)
+			;
+		nocache_qmask--;
+		nocache_worker_all = 1;
+	}
+	pthread_atfork(nocache_locks_take, nocache_locks_give, nocache_locks_fork);
+	nocache_fds_init();
+	nocache_rules_init();
+	nocache_budget_init();
+	nocache_stats_init();
+	nocache_maps_init();
+	nocache_direct_init(&nocache_conf_env);
+	nocache_control_init();
+	nocache_trace_init();
+	nocache_psi_init();
+	nocache_hot_init();
+	errno = error;
+}
+
+#define NOCACHE_PERROR(fd, off, len, msg) 	\
+	do {					\
+		int error = errno;		\
+		if (nocache_dontneed(fd, off, len) != 0)	\
+			DEBUG_PERROR(msg);	\
+		errno = error;			\
+	} while (0)
+
+#define NOCACHE_NOTSEQ_PERROR(fd, msg) 		\
+	do {					\
+		int error = errno;		\
+		if (nocache_fadvise(fd, 0, 0, POSIX_FADV_RANDOM) != 0)	\
+			DEBUG_PERROR(msg);	\
+		errno = error;			\
+	} while (0)
+
+#define NOCACHE_FD_PERROR(fd, off, len, msg)	\
+	do {					\
+		NOCACHE_NOTSEQ_PERROR(fd, msg);	\
+		NOCACHE_PERROR(fd, off, len, msg);	\
+	} while (0)
+
+static void nocache_fd_hi(int fd)
+{
+	int hi = __atomic_load_n(&nocache_fdhi, __ATOMIC_RELAXED);
+
+	while (fd > hi && !__atomic_compare_exchange_n(&nocache_fdhi, &hi, fd, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static int nocache_fd_trylock(struct nocache_fd *nf)
+{
+	return !__atomic_test_and_set(&nf->lock, __ATOMIC_ACQUIRE);
+}
+
+static void nocache_fd_unlock(struct nocache_fd *nf)
+{
+	__atomic_clear(&nf->lock, __ATOMIC_RELEASE);
+}
+
+/* Direct I/O alignment of the file, or 0 when the filesystem says it has none */
+static void nocache_direct_align(int fd, struct nocache_fd *nf)
+{
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+	&& (stx.stx_mask & STATX_DIOALIGN) != 0) {
+		nf->dalign = stx.stx_dio_offset_align > stx.stx_dio_mem_align
+			? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+		nf->direct = nf->dalign != 0 && nf->dalign <= nocache_direct_chunk;
+		return;
+	}
+#endif
+	(void)fd;
+	nf->dalign = NOCACHE_DIRECT_ALIGN;
+	nf->direct = 1;
+}
+
+/*
+ * Hot files: a count-min sketch of NOCACHE_HOT_DEPTH rows keyed by device and
+ * inode counts opens, mappings and reads that go back over data already read
+ * through the same descriptor.  Files whose estimate reaches NOCACHE_HOT are
+ * not evicted.  Every NOCACHE_HOT_DECAY events all counters are halved so
+ * files cool down again.  Counters are updated with relaxed atomics only; a
+ * halving racing an increment may lose that increment, which a sketch can
+ * live with.  NOCACHE_HOT_SHM shares the sketch between processes.
+ */
+static uint64_t nocache_hot_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t)dev * 0x9e3779b97f4a7c15ull ^ (uint64_t)ino;
+
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	return h ^ (h >> 31);
+}
+
+#define NOCACHE_HOT_SLOT(h, i, w)	((i) * (w) + (((uint32_t)(h) + (i) * (uint32_t)((h) >> 32)) & ((w) - 1)))
+
+static void nocache_hot_touch(dev_t dev, ino_t ino)
+{
+	uint64_t h, n;
+	uint32_t w, i;
+
+	if (nocache_hot == NULL || (dev == 0 && ino == 0))
+		return;
+	w = nocache_hot->width;
+	h = nocache_hot_hash(dev, ino);
+	for (i = 0; i < NOCACHE_HOT_DEPTH; i++)
+		__atomic_fetch_add(&nocache_hot->count[NOCACHE_HOT_SLOT(h, i, w)], 1, __ATOMIC_RELAXED);
+	n = __atomic_add_fetch(&nocache_hot->events, 1, __ATOMIC_RELAXED);
+	if (n % nocache_hot_decay != 0)
+		return;
+	for (i = 0; i < NOCACHE_HOT_DEPTH * w; i++)
+		__atomic_store_n(&nocache_hot->count[i],
+			__atomic_load_n(&nocache_hot->count[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+}
+
+static int nocache_hot_test(dev_t dev, ino_t ino)
+{
+	uint64_t h;
+	uint32_t w, i;
+
+	if (nocache_hot == NULL || (dev == 0 && ino == 0))
+		return 0;
+	w = nocache_hot->width;
+	h = nocache_hot_hash(dev, ino);
+	for (i = 0; i < NOCACHE_HOT_DEPTH; i++)
+		if (__atomic_load_n(&nocache_hot->count[NOCACHE_HOT_SLOT(h, i, w)], __ATOMIC_RELAXED) < nocache_hot_min)
+			return 0;
+	return 1;
+}
+
+/*
+ * Preserve mode: the pages of a file already resident when a descriptor is
+ * first seen get one bit each, and DONTNEED ranges are cut around them so
+ * only what this process brought in is dropped.  Files with nothing cached
+ * get no bitmap at all.
+ */
+#define NOCACHE_KEEP_BITS	(8 * sizeof(unsigned long))
+#define NOCACHE_KEEP_SIZE(n)	(((n) + NOCACHE_KEEP_BITS - 1) / NOCACHE_KEEP_BITS * sizeof(unsigned long))
+#define NOCACHE_KEEP_TEST(k, p)	(((k)[(p) / NOCACHE_KEEP_BITS] >> ((p) % NOCACHE_KEEP_BITS)) & 1)
+#define NOCACHE_KEEP_SET(k, p)	((k)[(p) / NOCACHE_KEEP_BITS] |= 1ul << ((p) % NOCACHE_KEEP_BITS))
+#define NOCACHE_KEEP_VEC	4096
+
+static void nocache_keep_free(struct nocache_fd *nf)
+{
+	if (nf->keep == NULL)
+		return;
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	libc_munmap(nf->keep, NOCACHE_KEEP_SIZE(nf->npages));
+	nf->keep = NULL;
+	nf->npages = 0;
+}
+
+static void nocache_keep_release(int fd)
+{
+	if (fd >= 0 && fd < nocache_nfds)
+		nocache_keep_free(&nocache_fds[fd]);
+}
+
+static unsigned long *nocache_keep_alloc(size_t npages)
+{
+	void *ptr;
+
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	ptr = libc_mmap(NULL, NOCACHE_KEEP_SIZE(npages), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	return ptr != MAP_FAILED ? ptr : NULL;
+}
+
+static int nocache_keep_mincore(int fd, unsigned long *keep, size_t npages, int shift)
+{
+	unsigned char vec[NOCACHE_KEEP_VEC];
+	char *map;
+	size_t i, j, n;
+
+	map = libc_mmap(NULL, npages << shift, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	for (i = 0; i < npages; i += n) {
+		n = npages - i < NOCACHE_KEEP_VEC ? npages - i : NOCACHE_KEEP_VEC;
+		if (mincore(map + (i << shift), n << shift, vec) != 0)
+			break;
+		for (j = 0; j < n; j++)
+			if ((vec[j] & 1) != 0)
+				NOCACHE_KEEP_SET(keep, i + j);
+	}
+	libc_munmap(map, npages << shift);
+	return i < npages ? -1 : 0;
+}
+
+/* Write-only descriptors cannot be mapped, halve [lo, hi) until cachestat() says all or none */
+static void nocache_keep_bisect(int fd, unsigned long *keep, size_t lo, size_t hi, int shift)
+{
+	struct nocache_cachestat_range csr = { (uint64_t)lo << shift, (uint64_t)(hi - lo) << shift };
+	struct nocache_cachestat cs;
+
+	if (syscall(__NR_cachestat, fd, &csr, &cs, 0) != 0 || cs.nr_cache == 0)
+		return;
+	if (cs.nr_cache >= hi - lo) {
+		for (; lo < hi; lo++)
+			NOCACHE_KEEP_SET(keep, lo);
+		return;
+	}
+	nocache_keep_bisect(fd, keep, lo, lo + (hi - lo) / 2, shift);
+	nocache_keep_bisect(fd, keep, lo + (hi - lo) / 2, hi, shift);
+}
+
+static void nocache_keep_snap(int fd, struct nocache_fd *nf, off_t size)
+{
+	struct nocache_cachestat_range csr = { 0, 0 };
+	struct nocache_cachestat cs;
+	unsigned long *keep;
+	size_t npages, i, n = 0;
+	int shift = __builtin_ctzl(nocache_pagemask + 1);
+
+	if (size <= 0 || (syscall(__NR_cachestat, fd, &csr, &cs, 0) == 0 && cs.nr_cache == 0))
+		return;
+	npages = ((uint64_t)size + nocache_pagemask) >> shift;
+	keep = nocache_keep_alloc(npages);
+	if (keep == NULL)
+		return;
+	if (nocache_keep_mincore(fd, keep, npages, shift) != 0) {
+		memset(keep, 0, NOCACHE_KEEP_SIZE(npages));
+		nocache_keep_bisect(fd, keep, 0, npages, shift);
+	}
+	for (i = 0; i < NOCACHE_KEEP_SIZE(npages) / sizeof *keep; i++)
+		n += __builtin_popcountl(keep[i]);
+	nf->keep = keep;
+	nf->npages = npages;
+	NOCACHE_STAT(preserve, 1);
+	NOCACHE_STAT(preserve_pages, n);
+}
+
+/* The snapshot of src when there is one, a fresh one of fd otherwise */
+static void nocache_keep_inherit(int fd, struct nocache_fd *nf, const struct nocache_fd *src)
+{
+	struct stat st;
+
+	if (src == NULL) {
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+			nocache_keep_snap(fd, nf, st.st_size);
+		return;
+	}
+	if (src->keep == NULL || (nf->keep = nocache_keep_alloc(src->npages)) == NULL)
+		return;
+	memcpy(nf->keep, src->keep, NOCACHE_KEEP_SIZE(src->npages));
+	nf->npages = src->npages;
+}
+
+/*
+ * First sight of a descriptor: one fstat() decides whether it is a regular
+ * file or block device worth evicting, and everything else is marked to
+ * bypass the library until close(), dup2() or dup3() reuses the number.
+ */
+static void nocache_fd_classify(int fd, struct nocache_fd *nf, unsigned char flags, unsigned char policy)
+{
+	struct stat st;
+
+	nf->pos = 0;
+	nf->lo = nf->hi = 0;
+	nf->wlo = nf->whi = 0;
+	nf->next = nf->ra = 0;
+	nf->wb_lo = nf->wb_sub = nf->wnext = 0;
+	nf->sio = 0;
+	nf->sio_count = 0;
+	nf->direct = 0;
+	nf->dalign = 0;
+	nf->seq = 0;
+	nf->pending = 0;
+	nf->dev = 0;
+	nf->ino = 0;
+	nf->rend = 0;
+	nf->lost = nf->lost_cur = 0;
+	nf->lost_lo = nf->lost_hi = 0;
+	nf->flush = 0;
+	nf->hint = NOCACHE_HINT_NONE;
+	if (policy == NOCACHE_POLICY_NOREUSE && !nocache_noreuse)
+		policy = NOCACHE_POLICY_BEHIND;
+	nf->policy = policy;
+	nocache_keep_free(nf);
+	flags |= NOCACHE_FD_SEEN;
+	if ((policy == NOCACHE_POLICY_NONE && nocache_trace_fd < 0)
+	|| fstat(fd, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))) {
+		flags |= NOCACHE_FD_SKIP;
+	} else if (policy == NOCACHE_POLICY_NONE || policy == NOCACHE_POLICY_NOREUSE) {
+		/* Left alone, or to the kernel's use-once handling, but still sampled by the tracer */
+		nf->dev = st.st_dev;
+		nf->ino = st.st_ino;
+		flags |= NOCACHE_FD_SKIP;
+		nocache_fd_hi(fd);
+		nocache_trace_start();
+		if (policy == NOCACHE_POLICY_NOREUSE && nocache_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE) == 0)
+			NOCACHE_STAT(noreuse, 1);
+	} else {
+		nf->dev = st.st_dev;
+		nf->ino = st.st_ino;
+		nocache_control_start();
+		nocache_trace_start();
+		nocache_hot_touch(nf->dev, nf->ino);
+		/* Inherited from a parent running in direct mode, unaligned I/O would fail outright */
+		if (nocache_direct && S_ISREG(st.st_mode) && (fcntl(fd, F_GETFL) & O_DIRECT) != 0)
+			nocache_direct_align(fd, nf);
+		if (nocache_preserve && S_ISREG(st.st_mode))
+			nocache_keep_snap(fd, nf, st.st_size);
+	}
+	__atomic_store_n(&nf->flags, flags, __ATOMIC_RELEASE);
+	if ((flags & NOCACHE_FD_SKIP) == 0) {
+		nocache_fd_hi(fd);
+		NOCACHE_NOTSEQ_PERROR(fd, NULL);
+	}
+}
+
+/* Table entry for fd, or NULL when fd is beyond the table and gets the per-call treatment */
+static struct nocache_fd *nocache_fd_get(int fd)
+{
+	struct nocache_fd *nf;
+
+	if (fd < 0 || fd >= nocache_nfds)
+		return NULL;
+	nf = &nocache_fds[fd];
+	if ((__atomic_load_n(&nf->flags, __ATOMIC_ACQUIRE) & NOCACHE_FD_SEEN) == 0
+	&& nocache_fd_trylock(nf)) {
+		if ((nf->flags & NOCACHE_FD_SEEN) == 0)
+			nocache_fd_classify(fd, nf, 0, NOCACHE_CONF()->policy);
+		nocache_fd_unlock(nf);
+	}
+	return nf;
+}
+
+static int nocache_fd_evictable(int fd)
+{
+	struct nocache_fd *nf;
+
+	if (fd < 0)
+		return 0;
+	nf = nocache_fd_get(fd);
+	return nf == NULL || (nf->flags & NOCACHE_FD_SKIP) == 0;
+}
+
+/* The program chose its own access pattern for fd, so POSIX_FADV_RANDOM is not forced on it */
+static int nocache_fd_hinted(int fd)
+{
+	return fd >= 0 && fd < nocache_nfds
+		&& __atomic_load_n(&nocache_fds[fd].hint, __ATOMIC_RELAXED) != NOCACHE_HINT_NONE;
+}
+
+static void nocache_fd_open(int fd, const char *pathname, int flags)
+{
+	struct nocache_fd *nf;
+
+	if (fd < 0 || fd >= nocache_nfds) {
+		NOCACHE_NOTSEQ_PERROR(fd, NULL);
+		return;
+	}
+	nf = &nocache_fds[fd];
+	nocache_fd_classify(fd, nf, NOCACHE_FD_POS | ((flags & O_APPEND) != 0 ? NOCACHE_FD_APPEND : 0),
+		nocache_rules_match(fd, pathname));
+}
+
+static void nocache_fd_seek(int fd, off_t pos)
+{
+	struct nocache_fd *nf;
+
+	if (fd < 0 || fd >= nocache_nfds)
+		return;
+	nf = &nocache_fds[fd];
+	if (!nocache_fd_trylock(nf)) {
+		__atomic_and_fetch(&nf->flags, ~NOCACHE_FD_POS, __ATOMIC_RELAXED);
+		return;
+	}
+	nf->pos = pos;
+	__atomic_or_fetch(&nf->flags, NOCACHE_FD_POS, __ATOMIC_RELAXED);
+	nocache_fd_unlock(nf);
+}
+
+/* File offset where the I/O of count bytes just completed through the file position began */
+static off_t nocache_fd_where(int fd, struct nocache_fd *nf, size_t count, int how)
+{
+	off_t end;
+
+	if ((nf->flags & NOCACHE_FD_NOSEEK) != 0)
+		return -1;
+	if ((nf->flags & NOCACHE_FD_POS) != 0
+	&& (how != NOCACHE_IO_WRITE || (nf->flags & NOCACHE_FD_APPEND) == 0)) {
+		end = nf->pos;
+		nf->pos += count;
+		return end;
+	}
+	COND_ASSIGN_DLSYM64_OR_DIE(lseek, lseek64);
+	end = libc_lseek(fd, 0, SEEK_CUR);
+	if (end < 0) {
+		if (errno == ESPIPE)
+			__atomic_or_fetch(&nf->flags, NOCACHE_FD_NOSEEK, __ATOMIC_RELAXED);
+		return -1;
+	}
+	nf->pos = end;
+	if ((nf->flags & NOCACHE_FD_APPEND) == 0)
+		__atomic_or_fetch(&nf->flags, NOCACHE_FD_POS, __ATOMIC_RELAXED);
+	return end - count;
+}
+
+#define NOCACHE_LEN(lo, hi)	((hi) == NOCACHE_EOF ? 0 : (hi) - (lo))
+
+struct nocache_adv {
+	off_t lo, hi;
+	int advice;
+};
+
+#define NOCACHE_ADV_MAX		6
+
+#define NOCACHE_ADV_WRITE	(-1)
+#define NOCACHE_ADV_WAIT	(-2)
+#define NOCACHE_ADV_SETTLE	(-3)
+
+static void nocache_adv_push(struct nocache_adv *adv, int *n, off_t lo, off_t hi, int advice)
+{
+	if (*n >= NOCACHE_ADV_MAX)
+		return;
+	adv[*n].lo = lo;
+	adv[*n].hi = hi;
+	adv[*n].advice = advice;
+	++*n;
+}
+
+#define NOCACHE_ALIGN_DOWN(off)	((off) & ~(off_t)nocache_align)
+#define NOCACHE_ALIGN_UP(off)	(((off) + (off_t)nocache_align) & ~(off_t)nocache_align)
+
+/*
+ * The kernel only drops folios that lie entirely inside a DONTNEED range,
+ * and readahead builds large ones, so ranges at least NOCACHE_ALIGN long
+ * are widened to whole granules; shorter ones are left exact.
+ */
+static void nocache_adv_evict(struct nocache_adv *adv, int *n, off_t lo, off_t hi)
+{
+	if (hi == NOCACHE_EOF || hi - lo > (off_t)nocache_align) {
+		lo = NOCACHE_ALIGN_DOWN(lo);
+		if (hi != NOCACHE_EOF)
+			hi = NOCACHE_ALIGN_UP(hi);
+	}
+	nocache_adv_push(adv, n, lo, hi, POSIX_FADV_DONTNEED);
+}
+
+/* DONTNEED [lo, hi) except the preserved pages; everything past the snapshot goes */
+static int nocache_keep_dontneed(int fd, const struct nocache_fd *nf, off_t lo, off_t hi)
+{
+	int shift = __builtin_ctzl(nocache_pagemask + 1), tail, ret = 0;
+	off_t top = (off_t)nf->npages << shift, a, b;
+	size_t p = lo >> shift, q, last;
+
+	tail = hi == NOCACHE_EOF || hi > top;
+	last = tail ? nf->npages : (size_t)((hi + (off_t)nocache_pagemask) >> shift);
+	while (p < last) {
+		if (NOCACHE_KEEP_TEST(nf->keep, p)) {
+			p++;
+			continue;
+		}
+		for (q = p + 1; q < last && !NOCACHE_KEEP_TEST(nf->keep, q); q++)
+			;
+		a = (off_t)p << shift;
+		if (a < lo)
+			a = lo;
+		b = q == nf->npages ? hi : (off_t)q << shift;
+		if (hi != NOCACHE_EOF && b > hi)
+			b = hi;
+		if (q == nf->npages)
+			tail = 0;
+		if (nocache_fadvise(fd, a, NOCACHE_LEN(a, b), POSIX_FADV_DONTNEED) != 0)
+			ret = -1;
+		p = q;
+	}
+	if (tail) {
+		a = lo > top ? lo : top;
+		if (nocache_fadvise(fd, a, NOCACHE_LEN(a, hi), POSIX_FADV_DONTNEED) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Daemon mode: with NOCACHE_DAEMON naming the socket of a running nocached,
+ * DONTNEED requests are passed to it with the descriptor attached and the
+ * call returns at once; the daemon merges requests for the same file from
+ * all processes and evicts at its own pace.  When the socket is missing or
+ * its queue is full the process evicts by itself.  So do files with a
+ * NOCACHE_PRESERVE bitmap: the daemon widens each file's requests to one
+ * span, which would take the preserved pages between them along.
+ */
+static int nocache_daemon_connect(void)
+{
+	struct sockaddr_un sun;
+	int state = 0, fd;
+
+	if (!__atomic_compare_exchange_n(&nocache_daemon_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return state == 2;
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (fd < 0 || strlen(nocache_daemon_path) >= sizeof sun.sun_path)
+		goto fail;
+	strcpy(sun.sun_path, nocache_daemon_path);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof sun) != 0)
+		goto fail;
+	nocache_daemon_fd = fd;
+	__atomic_store_n(&nocache_daemon_refs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&nocache_daemon_state, 2, __ATOMIC_RELEASE);
+	return 1;
+fail:
+	if (fd >= 0)
+		libc_close(fd);
+	__atomic_store_n(&nocache_daemon_state, -1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Takes a reference on the socket unless the last one is already gone */
+static int nocache_daemon_get(void)
+{
+	int refs = __atomic_load_n(&nocache_daemon_refs, __ATOMIC_RELAXED);
+
+	do {
+		if (refs <= 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&nocache_daemon_refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return 1;
+}
+
+static void nocache_daemon_put(void)
+{
+	if (__atomic_sub_fetch(&nocache_daemon_refs, 1, __ATOMIC_ACQ_REL) == 0)
+		libc_close(nocache_daemon_fd);
+}
+
+static int nocache_daemon_send(int fd, off_t off, off_t len)
+{
+	struct nocache_daemon_msg msg;
+	struct iovec iov = { &msg, sizeof msg };
+	union {
+		char buf[CMSG_SPACE(sizeof fd)];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	int error = errno, state = 2;
+
+	if (nocache_daemon_path == NULL || !nocache_daemon_connect() || !nocache_daemon_get())
+		return -1;
+	msg.version = NOCACHE_DAEMON_VERSION;
+	msg.pid = getpid();
+	msg.off = off;
+	msg.len = len;
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof ctl.buf;
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof fd);
+	memcpy(CMSG_DATA(cm), &fd, sizeof fd);
+	if (sendmsg(nocache_daemon_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL) == (ssize_t)sizeof msg) {
+		nocache_daemon_put();
+		NOCACHE_STAT(daemon, 1);
+		return 0;
+	}
+	/*
+	 * A daemon that went away stays gone for this process and its socket is
+	 * closed once no other sender uses it, a full queue is only skipped
+	 */
+	if ((errno == ECONNREFUSED || errno == ENOTCONN) &&
+	    __atomic_compare_exchange_n(&nocache_daemon_state, &state, -1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		nocache_daemon_put();
+	nocache_daemon_put();
+	NOCACHE_STAT(daemon_failed, 1);
+	errno = error;
+	return -1;
+}
+
+/* Every DONTNEED of the page cache goes through here, len 0 meaning to end of file */
+static int nocache_dontneed(int fd, off_t off, off_t len)
+{
+	if (NOCACHE_CONF()->off)
+		return 0;
+	if (!nocache_psi_evict()) {
+		NOCACHE_STAT(psi_skipped, 1);
+		return 0;
+	}
+	if (nocache_hot != NULL && fd >= 0 && fd < nocache_nfds
+	&& nocache_hot_test(nocache_fds[fd].dev, nocache_fds[fd].ino)) {
+		NOCACHE_STAT(hot_skipped, 1);
+		return 0;
+	}
+	/* Never through the daemon, its merging would cover the kept pages */
+	if (fd >= 0 && fd < nocache_nfds && nocache_fds[fd].keep != NULL)
+		return nocache_keep_dontneed(fd, &nocache_fds[fd], off, len == 0 ? NOCACHE_EOF : off + len);
+	if (nocache_daemon_send(fd, off, len) == 0)
+		return 0;
+	return nocache_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+static void nocache_adv_do(int fd, off_t lo, off_t hi, int advice, const char *msg)
+{
+	switch (advice) {
+	case NOCACHE_ADV_WRITE:
+		if (nocache_sync_range(fd, lo, NOCACHE_LEN(lo, hi), SYNC_FILE_RANGE_WRITE) != 0)
+			DEBUG_PERROR(msg);
+		break;
+	case NOCACHE_ADV_WAIT:
+		if (nocache_sync_range(fd, lo, NOCACHE_LEN(lo, hi),
+			SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+			DEBUG_PERROR(msg);
+		break;
+	case NOCACHE_ADV_SETTLE:
+		/* Writeback the caller of msync(MS_ASYNC) did not wait for, then the clean pages go */
+		if (nocache_sync_range(fd, lo, NOCACHE_LEN(lo, hi),
+			SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+			DEBUG_PERROR(msg);
+		/* fall through */
+	case POSIX_FADV_DONTNEED:
+		if (nocache_dontneed(fd, lo, NOCACHE_LEN(lo, hi)) != 0)
+			DEBUG_PERROR(msg);
+		break;
+	default:
+		if (nocache_fadvise(fd, lo, NOCACHE_LEN(lo, hi), advice) != 0)
+			DEBUG_PERROR(msg);
+	}
+}
+
+/*
+ * Worker thread fed through a bounded lock-free queue (Vyukov style, one
+ * sequence number per slot), started by the first msync(MS_ASYNC) or, with
+ * NOCACHE_WORKER, by the first advice.  Each descriptor counts its queued
+ * records so close() can wait for them before the number is reused.
+ */
+static void nocache_q_reset(void)
+{
+	unsigned long i;
+
+	for (i = 0; i <= nocache_qmask; i++)
+		nocache_q[i].seq = i;
+	nocache_qhead = nocache_qtail = 0;
+	nocache_qsleep = 0;
+}
+
+static int nocache_q_peek(void)
+{
+	unsigned long pos = __atomic_load_n(&nocache_qtail, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&nocache_q[pos & nocache_qmask].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+static void nocache_q_wake(void)
+{
+	if (__atomic_exchange_n(&nocache_qsleep, 0, __ATOMIC_SEQ_CST) != 0)
+		sem_post(&nocache_qsem);
+}
+
+static int nocache_q_push(int fd, const struct nocache_adv *adv)
+{
+	struct nocache_rec *r;
+	unsigned long pos;
+	long dif;
+
+	pos = __atomic_load_n(&nocache_qhead, __ATOMIC_RELAXED);
+	for (;;) {
+		r = &nocache_q[pos & nocache_qmask];
+		dif = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&nocache_qhead, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&nocache_qhead, __ATOMIC_RELAXED);
+		}
+	}
+	r->fd = fd;
+	r->advice = adv->advice;
+	r->lo = adv->lo;
+	r->hi = adv->hi;
+	__atomic_add_fetch(&nocache_fds[fd].queued, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int nocache_q_pop(struct nocache_rec *out)
+{
+	struct nocache_rec *r;
+	unsigned long pos = nocache_qtail;
+
+	r = &nocache_q[pos & nocache_qmask];
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return -1;
+	*out = *r;
+	__atomic_store_n(&r->seq, pos + nocache_qmask + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&nocache_qtail, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Merge a DONTNEED into the latest record for the same descriptor when the ranges touch */
+static int nocache_q_merge(struct nocache_rec *batch, int n, const struct nocache_rec *r)
+{
+	int i;
+
+	for (i = n - 1; i >= 0; i--) {
+		if (batch[i].fd != r->fd)
+			continue;
+		if (batch[i].advice != POSIX_FADV_DONTNEED || r->advice != POSIX_FADV_DONTNEED
+		|| r->hi < batch[i].lo || r->lo > batch[i].hi
+		|| batch[i].hi == NOCACHE_EOF || r->hi == NOCACHE_EOF)
+			return 0;
+		if (r->lo < batch[i].lo) batch[i].lo = r->lo;
+		if (r->hi > batch[i].hi) batch[i].hi = r->hi;
+		batch[i].seq++;
+		return 1;
+	}
+	return 0;
+}
+
+static void *nocache_worker(void *arg)
+{
+	struct nocache_rec batch[NOCACHE_WORKER_BATCH], r;
+	int i, n;
+
+	(void)arg;
+	for (;;) {
+		n = 0;
+		while (n < NOCACHE_WORKER_BATCH && nocache_q_pop(&r) == 0) {
+			if (nocache_q_merge(batch, n, &r))
+				continue;
+			batch[n] = r;
+			batch[n++].seq = 1;
+		}
+		if (n == 0) {
+			__atomic_store_n(&nocache_qsleep, 1, __ATOMIC_SEQ_CST);
+			if (!nocache_q_peek())
+				while (sem_wait(&nocache_qsem) != 0 && errno == EINTR)
+					;
+			__atomic_store_n(&nocache_qsleep, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			nocache_adv_do(batch[i].fd, batch[i].lo, batch[i].hi, batch[i].advice, NULL);
+			__atomic_sub_fetch(&nocache_fds[batch[i].fd].queued, batch[i].seq, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+static void nocache_worker_fork(void)
+{
+	int fd;
+
+	if (nocache_q == NULL)
+		return;
+	for (fd = 0; fd <= nocache_fdhi; fd++)
+		nocache_fds[fd].queued = 0;
+	nocache_q_reset();
+	nocache_qstate = 0;
+}
+
+static int nocache_worker_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	void *ptr;
+	int state = 0, ret;
+
+	if (!__atomic_compare_exchange_n(&nocache_qstate, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return state == 2;
+	if (nocache_q == NULL) {
+		COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+		ptr = libc_mmap(NULL, (nocache_qmask + 1) * sizeof *nocache_q, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		nocache_q = ptr;
+		nocache_q_reset();
+		pthread_atfork(NULL, NULL, nocache_worker_fork);
+	}
+	if (sem_init(&nocache_qsem, 0, 0) != 0)
+		goto fail;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&tid, &attr, nocache_worker, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+		goto fail;
+	__atomic_store_n(&nocache_qstate, 2, __ATOMIC_RELEASE);
+	return 1;
+fail:
+	__atomic_store_n(&nocache_qstate, -1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Wait until the worker has issued every record queued for fd */
+static void nocache_worker_wait(int fd)
+{
+	if (nocache_q == NULL || fd < 0 || fd >= nocache_nfds)
+		return;
+	while (__atomic_load_n(&nocache_fds[fd].queued, __ATOMIC_ACQUIRE) != 0) {
+		nocache_q_wake();
+		sched_yield();
+	}
+}
+
+/*
+ * sync_file_range() waits stay on the caller so write-behind still throttles
+ * the writer; everything else goes to the worker when one is configured,
+ * falling back to the caller when the queue is full.
+ */
+static void nocache_adv_issue(int fd, const struct nocache_adv *adv, int n, const char *msg)
+{
+	int i, queued = 0, error = errno;
+
+	for (i = 0; i < n; i++) {
+		if (nocache_worker_all && adv[i].advice != NOCACHE_ADV_WAIT
+		&& fd >= 0 && fd < nocache_nfds && nocache_worker_start()
+		&& nocache_q_push(fd, &adv[i]) == 0) {
+			NOCACHE_STAT(queued, 1);
+			queued = 1;
+			continue;
+		}
+		if (nocache_worker_all && adv[i].advice != NOCACHE_ADV_WAIT)
+			NOCACHE_STAT(queue_full, 1);
+		if (queued && adv[i].advice == NOCACHE_ADV_WAIT)
+			nocache_worker_wait(fd);
+		nocache_adv_do(fd, adv[i].lo, adv[i].hi, adv[i].advice, msg);
+	}
+	if (queued)
+		nocache_q_wake();
+	errno = error;
+}
+
+/* Private descriptor for a mapping or aged ranges, marked so the I/O paths ignore it and close() can tell */
+static int nocache_map_dup(int fd, dev_t dev, ino_t ino)
+{
+	struct rlimit rl;
+	long top = NOCACHE_DUP_TOP;
+	int dup, error = errno;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)top)
+		top = rl.rlim_cur;
+	dup = fcntl(fd, F_DUPFD_CLOEXEC, top - top / 4);
+	if (dup >= top) {
+		libc_close(dup);
+		dup = -1;
+	}
+	errno = error;
+	if (dup < 0 || dup >= nocache_nfds)
+		return dup;
+	nocache_fds[dup].dev = dev;
+	nocache_fds[dup].ino = ino;
+	nocache_keep_free(&nocache_fds[dup]);
+	if (nocache_preserve)
+		nocache_keep_inherit(dup, &nocache_fds[dup], fd >= 0 && fd < nocache_nfds
+			&& (nocache_fds[fd].flags & NOCACHE_FD_SEEN) != 0 ? &nocache_fds[fd] : NULL);
+	__atomic_store_n(&nocache_fds[dup].flags, NOCACHE_FD_SEEN|NOCACHE_FD_SKIP|NOCACHE_FD_MAP, __ATOMIC_RELEASE);
+	return dup;
+}
+
+static void nocache_map_close(int fd)
+{
+	if (fd < 0)
+		return;
+	nocache_worker_wait(fd);
+	if (fd < nocache_nfds)
+		__atomic_store_n(&nocache_fds[fd].flags, 0, __ATOMIC_RELAXED);
+	nocache_keep_release(fd);
+	libc_close(fd);
+}
+
+/*
+ * Budget mode: every range moved through a descriptor becomes a record in
+ * one LRU shared by all descriptors (index 0 is nil), and once the bytes
+ * they cover exceed NOCACHE_BUDGET the least recently used records are
+ * evicted.  Records of other descriptors are advised while the budget lock
+ * is held (or queued to the worker), so close() cannot race them.
+ */
+static void nocache_lru_unlink(int i)
+{
+	struct nocache_range *r = &nocache_ranges[i];
+
+	if (r->prev != 0) nocache_ranges[r->prev].next = r->next;
+	else nocache_lru_head = r->next;
+	if (r->next != 0) nocache_ranges[r->next].prev = r->prev;
+	else nocache_lru_tail = r->prev;
+}
+
+static void nocache_lru_push(int i)
+{
+	struct nocache_range *r = &nocache_ranges[i];
+
+	r->prev = 0;
+	r->next = nocache_lru_head;
+	if (nocache_lru_head != 0) nocache_ranges[nocache_lru_head].prev = i;
+	else nocache_lru_tail = i;
+	nocache_lru_head = i;
+}
+
+static void nocache_range_release(int i)
+{
+	struct nocache_range *r = &nocache_ranges[i];
+
+	nocache_lru_unlink(i);
+	if (r->fprev != 0) nocache_ranges[r->fprev].fnext = r->fnext;
+	else nocache_fds[r->fd].ranges = r->fnext;
+	if (r->fnext != 0) nocache_ranges[r->fnext].fprev = r->fprev;
+	nocache_cached -= r->hi - r->lo;
+	r->next = nocache_range_free;
+	nocache_range_free = i;
+}
+
+static size_t nocache_range_resident(int fd, off_t lo, off_t hi)
+{
+	struct nocache_cachestat_range csr = { lo, hi - lo };
+	struct nocache_cachestat cs;
+
+	if (syscall(__NR_cachestat, fd, &csr, &cs, 0) != 0) {
+		if (errno == ENOSYS)
+			nocache_budget_check = 0;
+		return hi - lo;
+	}
+	return cs.nr_cache * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void nocache_range_evict(int fd, off_t lo, off_t hi, int sync)
+{
+	struct nocache_adv adv[1];
+	int n = 0;
+
+	if (nocache_budget_check && nocache_range_resident(fd, lo, hi) == 0)
+		return;
+	nocache_adv_evict(adv, &n, lo, hi);
+	if (sync || !nocache_worker_all || !nocache_worker_start() || nocache_q_push(fd, adv) != 0) {
+		nocache_adv_do(fd, adv->lo, adv->hi, adv->advice, NULL);
+	} else {
+		NOCACHE_STAT(queued, 1);
+		nocache_q_wake();
+	}
+}
+
+/* Evict and forget record i, closing the duplicate it was handed over to at close() once that holds none */
+static void nocache_range_expire(int i)
+{
+	int fd = nocache_ranges[i].fd;
+
+	nocache_range_evict(fd, nocache_ranges[i].lo, nocache_ranges[i].hi, 0);
+	nocache_range_release(i);
+	if (nocache_fds[fd].ranges == 0 && (nocache_fds[fd].flags & NOCACHE_FD_MAP) != 0) {
+		nocache_map_close(fd);
+		nocache_age_dups--;
+	}
+}
+
+/*
+ * NOCACHE_AGE=<ms> keeps what a descriptor moved cached for that long after
+ * its last access instead of evicting it at once: the records are those of
+ * budget mode, stamped at every touch and capped at NOCACHE_AGE_RANGE bytes
+ * each so a long stream ages piecewise, and a helper thread evicts from the LRU
+ * tail whatever has been idle long enough.  The records of a closed
+ * descriptor move to a private duplicate and age out from there, for up to
+ * NOCACHE_AGE_FILES closed files at a time (default 64, each costs the
+ * program a descriptor) beyond which close() evicts as before; at exit
+ * everything left is evicted.
+ */
+static void nocache_age_expire(uint64_t now)
+{
+	int t;
+
+	pthread_mutex_lock(&nocache_budget_lock);
+	while ((t = nocache_lru_tail) != 0 && nocache_ranges[t].used + nocache_age_ns <= now) {
+		nocache_range_expire(t);
+		NOCACHE_STAT(aged, 1);
+	}
+	pthread_mutex_unlock(&nocache_budget_lock);
+}
+
+static void *nocache_age_thread(void *arg)
+{
+	struct timespec ts;
+	uint64_t ns = nocache_age_ns / 4;
+
+	(void)arg;
+	if (ns < 10000000)
+		ns = 10000000;
+	else if (ns > 1000000000)
+		ns = 1000000000;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	for (;;) {
+		nanosleep(&ts, NULL);
+		nocache_age_expire(nocache_now());
+	}
+	return NULL;
+}
+
+static void nocache_age_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	int state = 0;
+
+	if (__atomic_load_n(&nocache_age_state, __ATOMIC_RELAXED) != 0
+	|| !__atomic_compare_exchange_n(&nocache_age_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&tid, &attr, nocache_age_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Account [off, end) to fd; the caller holds the descriptor lock */
+static void nocache_budget_touch(int fd, struct nocache_fd *nf, off_t off, off_t end, size_t budget,
+	struct nocache_adv *adv, int *n)
+{
+	struct nocache_range *r;
+	int i, t;
+	off_t cut;
+	int error = errno;
+
+	if (pthread_mutex_trylock(&nocache_budget_lock) != 0) {
+		nocache_adv_push(adv, n, off, end, POSIX_FADV_DONTNEED);
+		return;
+	}
+	i = nf->ranges;
+	r = &nocache_ranges[i];
+	if (i != 0 && off <= r->hi && end >= r->lo && (nocache_age_ns == 0
+	|| (size_t)((end > r->hi ? end : r->hi) - (off < r->lo ? off : r->lo)) <= NOCACHE_AGE_RANGE)) {
+		nocache_cached -= r->hi - r->lo;
+		if (off < r->lo) r->lo = off;
+		if (end > r->hi) r->hi = end;
+		nocache_cached += r->hi - r->lo;
+		nocache_lru_unlink(i);
+		nocache_lru_push(i);
+	} else {
+		if (nocache_range_free == 0)
+			nocache_range_expire(nocache_lru_tail);
+		i = nocache_range_free;
+		r = &nocache_ranges[i];
+		nocache_range_free = r->next;
+		r->fd = fd;
+		r->lo = off;
+		r->hi = end;
+		r->fprev = 0;
+		r->fnext = nf->ranges;
+		if (nf->ranges != 0)
+			nocache_ranges[nf->ranges].fprev = i;
+		nf->ranges = i;
+		nocache_cached += end - off;
+		nocache_lru_push(i);
+	}
+	if (nocache_age_ns != 0) {
+		r->used = nocache_now();
+		nocache_age_start();
+	}
+	while (nocache_cached > budget && (t = nocache_lru_tail) != 0) {
+		r = &nocache_ranges[t];
+		if (t == i) {
+			cut = NOCACHE_ALIGN_DOWN(r->hi - (off_t)(budget / 2));
+			if (cut > r->lo) {
+				nocache_adv_evict(adv, n, r->lo, cut);
+				nocache_cached -= cut - r->lo;
+				r->lo = cut;
+			}
+			break;
+		}
+		nocache_range_expire(t);
+	}
+	pthread_mutex_unlock(&nocache_budget_lock);
+	errno = error;
+}
+
+/* Descriptor is going away: its records can no longer be advised later, unless aging hands them over */
+static void nocache_budget_drop(int fd)
+{
+	struct nocache_fd *nf;
+	int i, dup;
+
+	if (nocache_ranges == NULL || fd < 0 || fd >= nocache_nfds || nocache_fds[fd].ranges == 0)
+		return;
+	nf = &nocache_fds[fd];
+	pthread_mutex_lock(&nocache_budget_lock);
+	if ((nf->flags & NOCACHE_FD_MAP) != 0 && nf->ranges != 0)
+		nocache_age_dups--;
+	else if (nocache_age_ns != 0 && !nocache_exiting && nocache_age_dups < nocache_age_files && nf->ranges != 0
+	&& (dup = nocache_map_dup(fd, nf->dev, nf->ino)) >= 0) {
+		if (dup < nocache_nfds) {
+			if (nocache_preserve) {
+				nocache_keep_free(&nocache_fds[dup]);
+				nocache_keep_inherit(dup, &nocache_fds[dup], nf);
+			}
+			for (i = nf->ranges; i != 0; i = nocache_ranges[i].fnext)
+				nocache_ranges[i].fd = dup;
+			nocache_fds[dup].ranges = nf->ranges;
+			nf->ranges = 0;
+			nocache_age_dups++;
+			pthread_mutex_unlock(&nocache_budget_lock);
+			return;
+		}
+		libc_close(dup);
+	}
+	while ((i = nocache_fds[fd].ranges) != 0) {
+		nocache_range_evict(fd, nocache_ranges[i].lo, nocache_ranges[i].hi, 1);
+		nocache_range_release(i);
+	}
+	pthread_mutex_unlock(&nocache_budget_lock);
+}
+
+/*
+ * Streaming reads keep kernel readahead, prefetch NOCACHE_AHEAD beyond the
+ * read position and leave NOCACHE_BEHIND resident behind it.  Anything
+ * that breaks the sequence drops the prefetched window and goes back to
+ * POSIX_FADV_RANDOM.  A program that gave its own RANDOM, SEQUENTIAL or
+ * NORMAL advice keeps it: RANDOM never streams, and the others still get
+ * the prefetch but no advice that would undo theirs.
+ */
+static void nocache_fd_stream(struct nocache_fd *nf, off_t off, off_t end, struct nocache_adv *adv, int *n)
+{
+	off_t prev = nf->next;
+	unsigned char hint = __atomic_load_n(&nf->hint, __ATOMIC_RELAXED);
+
+	if (off == prev && hint != POSIX_FADV_RANDOM) {
+		if (nf->seq < NOCACHE_SEQ_MIN)
+			nf->seq++;
+	} else {
+		nf->seq = 0;
+	}
+	nf->next = end;
+	if (nf->seq < NOCACHE_SEQ_MIN) {
+		if ((nf->flags & NOCACHE_FD_STREAM) != 0) {
+			__atomic_and_fetch(&nf->flags, ~NOCACHE_FD_STREAM, __ATOMIC_RELAXED);
+			if (hint == NOCACHE_HINT_NONE)
+				nocache_adv_push(adv, n, 0, 0, POSIX_FADV_RANDOM);
+			if (nf->ra > prev)
+				nocache_adv_push(adv, n, prev, nf->ra, POSIX_FADV_DONTNEED);
+		}
+		return;
+	}
+	if ((nf->flags & NOCACHE_FD_STREAM) == 0) {
+		__atomic_or_fetch(&nf->flags, NOCACHE_FD_STREAM, __ATOMIC_RELAXED);
+		if (hint == NOCACHE_HINT_NONE)
+			nocache_adv_push(adv, n, 0, 0, POSIX_FADV_SEQUENTIAL);
+		nf->ra = end;
+	}
+	if (nf->ra < end)
+		nf->ra = end;
+	if ((size_t)(nf->ra - end) <= nocache_ahead / 2) {
+		nocache_adv_push(adv, n, nf->ra, end + nocache_ahead, POSIX_FADV_WILLNEED);
+		nf->ra = end + nocache_ahead;
+	}
+}
+
+/*
+ * Write-behind: once NOCACHE_WRITEBEHIND bytes of a sequential writer are
+ * dirty, start their writeback and wait on the chunk submitted before it,
+ * which is then clean and can really be dropped.  A writer that jumps
+ * elsewhere first settles what it left behind.
+ */
+static void nocache_fd_wbehind(struct nocache_fd *nf, off_t off, off_t end, struct nocache_adv *adv, int *n)
+{
+	if (off != nf->wnext) {
+		if (nf->wnext > nf->wb_lo) {
+			nocache_adv_push(adv, n, nf->wb_lo, nf->wnext, NOCACHE_ADV_WAIT);
+			nocache_adv_push(adv, n, nf->wb_lo, nf->wnext, POSIX_FADV_DONTNEED);
+		}
+		nf->wb_lo = nf->wb_sub = off;
+	}
+	nf->wnext = end;
+	if ((size_t)(nf->wnext - nf->wb_sub) < nocache_wbehind)
+		return;
+	nocache_adv_push(adv, n, nf->wb_sub, nf->wnext, NOCACHE_ADV_WRITE);
+	if (nf->wb_sub > nf->wb_lo) {
+		nocache_adv_push(adv, n, nf->wb_lo, nf->wb_sub, NOCACHE_ADV_WAIT);
+		nocache_adv_push(adv, n, nf->wb_lo, nf->wb_sub, POSIX_FADV_DONTNEED);
+		nf->wb_lo = nf->wb_sub;
+	}
+	nf->wb_sub = nf->wnext;
+}
+
+/*
+ * Another thread holds the entry: leave the I/O to whoever takes it next.
+ * The span of the I/O at known offsets is kept (lost_lo is one above the
+ * start so that 0 means none); of I/O through the file position only the
+ * bytes are counted.
+ */
+static void nocache_fd_defer(struct nocache_fd *nf, off_t off, size_t count)
+{
+	off_t cur;
+
+	if (off < 0) {
+		__atomic_add_fetch(&nf->lost_cur, count, __ATOMIC_RELAXED);
+		return;
+	}
+	cur = __atomic_load_n(&nf->lost_hi, __ATOMIC_RELAXED);
+	while (off + (off_t)count > cur && !__atomic_compare_exchange_n(&nf->lost_hi, &cur, off + (off_t)count, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	cur = __atomic_load_n(&nf->lost_lo, __ATOMIC_RELAXED);
+	while ((cur == 0 || off + 1 < cur) && !__atomic_compare_exchange_n(&nf->lost_lo, &cur, off + 1, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	__atomic_add_fetch(&nf->lost, count, __ATOMIC_RELEASE);
+}
+
+static void nocache_fd_merge(struct nocache_fd *nf, off_t lo, off_t hi, size_t count)
+{
+	if (nf->pending == 0) {
+		nf->lo = lo;
+		nf->hi = hi;
+	} else {
+		nf->lo = lo < nf->lo ? lo : nf->lo;
+		nf->hi = hi > nf->hi ? hi : nf->hi;
+	}
+	nf->pending += count;
+}
+
+/*
+ * Fold what nocache_fd_defer() left into the pending range, the caller holds
+ * the entry.  Threads sharing a file position move through adjacent ranges,
+ * so the bytes read or written through it end where the position is now.
+ */
+static void nocache_fd_adopt(int fd, struct nocache_fd *nf)
+{
+	size_t lost;
+	off_t lo, hi;
+
+	lost = __atomic_exchange_n(&nf->lost, 0, __ATOMIC_ACQUIRE);
+	if (lost != 0) {
+		lo = __atomic_exchange_n(&nf->lost_lo, 0, __ATOMIC_RELAXED) - 1;
+		hi = __atomic_exchange_n(&nf->lost_hi, 0, __ATOMIC_RELAXED);
+		if (lo >= 0 && hi > lo)
+			nocache_fd_merge(nf, lo, hi, lost);
+	}
+	lost = __atomic_exchange_n(&nf->lost_cur, 0, __ATOMIC_RELAXED);
+	if (lost == 0 || (nf->flags & NOCACHE_FD_NOSEEK) != 0)
+		return;
+	__atomic_and_fetch(&nf->flags, ~NOCACHE_FD_POS, __ATOMIC_RELAXED);
+	COND_ASSIGN_DLSYM64_OR_DIE(lseek, lseek64);
+	hi = libc_lseek(fd, 0, SEEK_CUR);
+	if (hi >= 0)
+		nocache_fd_merge(nf, hi > (off_t)lost ? hi - (off_t)lost : 0, hi, lost);
+}
+
+static void nocache_fd_flush(int fd, int closing, const char *msg);
+
+/*
+ * Accumulate [off, off + count) into the pending range of fd and evict only
+ * what was touched once NOCACHE_BATCH bytes have moved, or sooner if the next
+ * range would stretch the pending range across a gap larger than a batch.
+ * Pass NOCACHE_OFF_CUR as off when the I/O went through the file position.
+ */
+static void nocache_fd_range(int fd, off_t off, size_t count, int how, const char *msg)
+{
+	const struct nocache_conf *conf = NOCACHE_CONF();
+	struct nocache_fd *nf;
+	struct nocache_adv adv[NOCACHE_ADV_MAX];
+	off_t end, lo, hi;
+	int n = 0, append;
+
+	if (conf->off) {
+		nocache_control_start();
+		return;
+	}
+	nf = nocache_fd_get(fd);
+	if (nf != NULL && (__atomic_load_n(&nf->flags, __ATOMIC_RELAXED) & NOCACHE_FD_SKIP) != 0)
+		return;
+	if (nf == NULL) {
+		if (off < 0)
+			NOCACHE_PERROR(fd, 0, 0, msg);
+		else
+			NOCACHE_PERROR(fd, off, count, msg);
+		return;
+	}
+	if (!nocache_fd_trylock(nf)) {
+		if (off < 0)
+			__atomic_and_fetch(&nf->flags, ~NOCACHE_FD_POS, __ATOMIC_RELAXED);
+		nocache_fd_defer(nf, off, count);
+		return;
+	}
+	if ((nf->flags & NOCACHE_FD_SEEN) == 0)
+		nocache_fd_classify(fd, nf, 0, conf->policy);
+	if ((nf->flags & NOCACHE_FD_SKIP) != 0)
+		goto unlock;
+	nocache_fd_adopt(fd, nf);
+	append = off < 0 && how == NOCACHE_IO_WRITE && (nf->flags & NOCACHE_FD_APPEND) != 0;
+	if (append && nf->pending != 0 && nf->hi == NOCACHE_EOF) {
+		nf->pending += count;
+		goto check;
+	}
+	if (off < 0) {
+		off = nocache_fd_where(fd, nf, count, how);
+		if (off < 0)
+			goto unlock;
+	}
+	if (how == NOCACHE_IO_READ && nocache_hot != NULL) {
+		if (off < nf->rend)
+			nocache_hot_touch(nf->dev, nf->ino);
+		nf->rend = off + (off_t)count;
+	}
+	end = append ? NOCACHE_EOF : off + (off_t)count;
+	if (nf->policy == NOCACHE_POLICY_CLOSE) {
+		if (nf->pending == 0 || off < nf->lo)
+			nf->lo = off;
+		if (nf->pending == 0 || end > nf->hi)
+			nf->hi = end;
+		nf->pending += count;
+		goto unlock;
+	}
+	if (how == NOCACHE_IO_WRITE && nocache_wbehind != 0 && !append) {
+		nocache_fd_wbehind(nf, off, end, adv, &n);
+		goto unlock;
+	}
+	if ((conf->budget != 0 || nocache_age_ns != 0) && nf->policy == NOCACHE_POLICY_BEHIND) {
+		nocache_budget_touch(fd, nf, off, off + (off_t)count, conf->budget != 0 ? conf->budget : SIZE_MAX, adv, &n);
+		goto unlock;
+	}
+	if (how == NOCACHE_IO_WRITE) {
+		if (nf->wlo == nf->whi) {
+			nf->wlo = off;
+			nf->whi = end;
+		} else {
+			if (off < nf->wlo) nf->wlo = off;
+			if (end > nf->whi) nf->whi = end;
+		}
+	} else if (nocache_ahead != 0) {
+		nocache_fd_stream(nf, off, end, adv, &n);
+	}
+	if (nf->pending != 0 && nf->policy != NOCACHE_POLICY_FULL) {
+		lo = off < nf->lo ? off : nf->lo;
+		hi = end > nf->hi ? end : nf->hi;
+		if (hi != NOCACHE_EOF && (size_t)(hi - lo) > nf->pending + count + nocache_batch) {
+			nocache_adv_evict(adv, &n, nf->lo, nf->hi);
+			nf->pending = 0;
+		}
+	}
+	nocache_fd_merge(nf, off, end, count);
+check:
+	if ((nf->flags & NOCACHE_FD_STREAM) != 0) {
+		hi = NOCACHE_ALIGN_DOWN(nf->hi - (off_t)nocache_behind);
+		if (hi - nf->lo >= (off_t)nocache_step && hi > nf->lo) {
+			nocache_adv_evict(adv, &n, nf->lo, hi);
+			nf->pending = nf->hi - hi;
+			nf->lo = hi;
+		}
+	} else if (nf->pending >= nocache_batch && nf->policy == NOCACHE_POLICY_FULL) {
+		nocache_adv_push(adv, &n, 0, NOCACHE_EOF, POSIX_FADV_DONTNEED);
+		nf->pending = 0;
+	} else if (nf->pending >= nocache_batch) {
+		hi = nf->hi == NOCACHE_EOF ? nf->hi : NOCACHE_ALIGN_DOWN(nf->hi);
+		if (hi > nf->lo) {
+			nocache_adv_evict(adv, &n, nf->lo, hi);
+			nf->pending = nf->hi - hi;
+			nf->lo = hi;
+		}
+	}
+unlock:
+	nocache_fd_unlock(nf);
+	nocache_adv_issue(fd, adv, n, msg);
+	/* A flush that found the entry busy was left to us, see nocache_fd_flush() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&nf->flush, __ATOMIC_RELAXED))
+		nocache_fd_flush(fd, 0, msg);
+}
+
+static void nocache_fd_io(int fd, off_t off, size_t count, int how, const char *msg)
+{
+	if (how == NOCACHE_IO_WRITE)
+		NOCACHE_STAT(bytes_written, count);
+	else
+		NOCACHE_STAT(bytes_read, count);
+	nocache_fd_range(fd, off, count, how, msg);
+}
+
+/*
+ * Evict everything pending plus whatever was written since the last flush.
+ * When another thread holds the entry the flush is left to it as it lets go
+ * in nocache_fd_range(), unless fd is closing: then only the ranges pending
+ * at that moment are evicted.
+ */
+static void nocache_fd_flush(int fd, int closing, const char *msg)
+{
+	struct nocache_fd *nf;
+	struct nocache_adv adv[NOCACHE_ADV_MAX];
+	off_t lo, hi;
+	int n = 0, locked;
+
+	if (fd < 0)
+		return;
+	if (fd >= nocache_nfds) {
+		NOCACHE_PERROR(fd, 0, 0, msg);
+		return;
+	}
+	nf = &nocache_fds[fd];
+	if ((nf->flags & (NOCACHE_FD_SEEN|NOCACHE_FD_SKIP)) != NOCACHE_FD_SEEN) {
+		if (closing)
+			__atomic_store_n(&nf->flags, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	locked = nocache_fd_trylock(nf);
+	if (!locked && closing) {
+		/* Nobody flushes a closed descriptor later, the holder may still be moving these */
+		lo = __atomic_load_n(&nf->lo, __ATOMIC_RELAXED);
+		hi = __atomic_load_n(&nf->hi, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&nf->pending, __ATOMIC_RELAXED) != 0 && lo < hi)
+			nocache_adv_evict(adv, &n, lo, hi);
+		lo = __atomic_load_n(&nf->wlo, __ATOMIC_RELAXED);
+		hi = __atomic_load_n(&nf->whi, __ATOMIC_RELAXED);
+		if (lo < hi)
+			nocache_adv_evict(adv, &n, lo, hi);
+		lo = __atomic_exchange_n(&nf->lost_lo, 0, __ATOMIC_RELAXED) - 1;
+		hi = __atomic_exchange_n(&nf->lost_hi, 0, __ATOMIC_RELAXED);
+		if (lo >= 0 && lo < hi)
+			nocache_adv_evict(adv, &n, lo, hi);
+		__atomic_store_n(&nf->lost, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&nf->lost_cur, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&nf->flush, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&nf->flags, 0, __ATOMIC_RELAXED);
+		nocache_adv_issue(fd, adv, n, msg);
+		nocache_budget_drop(fd);
+		return;
+	}
+	if (!locked) {
+		/* Unless the holder let go meanwhile, it has yet to look at flush */
+		__atomic_store_n(&nf->flush, 1, __ATOMIC_SEQ_CST);
+		if (!nocache_fd_trylock(nf))
+			return;
+	}
+	__atomic_store_n(&nf->flush, 0, __ATOMIC_RELAXED);
+	nocache_fd_adopt(fd, nf);
+	lo = nf->lo;
+	hi = nf->hi;
+	if (nf->pending == 0) {
+		lo = nf->wlo;
+		hi = nf->whi;
+	} else if (nf->wlo != nf->whi) {
+		if (nf->wlo < lo) lo = nf->wlo;
+		if (nf->whi > hi) hi = nf->whi;
+	}
+	if ((nf->flags & NOCACHE_FD_STREAM) != 0 && nf->ra > nf->next) {
+		if (lo == hi)
+			lo = nf->next;
+		if (nf->ra > hi && hi != NOCACHE_EOF)
+			hi = nf->ra;
+	}
+	if (lo != hi && nf->policy == NOCACHE_POLICY_FULL)
+		nocache_adv_push(adv, &n, 0, NOCACHE_EOF, POSIX_FADV_DONTNEED);
+	else if (lo != hi)
+		nocache_adv_evict(adv, &n, lo, hi);
+	if (nf->wnext > nf->wb_lo) {
+		nocache_adv_push(adv, &n, nf->wb_lo, nf->wnext, NOCACHE_ADV_WAIT);
+		nocache_adv_push(adv, &n, nf->wb_lo, nf->wnext, POSIX_FADV_DONTNEED);
+		nf->wb_lo = nf->wb_sub = nf->wnext;
+	}
+	nf->pending = 0;
+	nf->wlo = nf->whi = 0;
+	if (closing)
+		__atomic_store_n(&nf->flags, 0, __ATOMIC_RELAXED);
+	nocache_fd_unlock(nf);
+	nocache_adv_issue(fd, adv, n, msg);
+	if (closing || nocache_exiting)
+		nocache_budget_drop(fd);
+}
+
+/*
+ * File mappings are kept sorted by address together with a private
+ * duplicate of the mapped descriptor, since the original is often closed
+ * right after mmap().  Pages still mapped cannot be dropped, so the file
+ * range behind an address range is evicted once munmap() has released it;
+ * msync() only takes the pages this process no longer maps.
+ */
+#define NOCACHE_MAP_LEN(len)	(((uintptr_t)(len) + nocache_pagemask) & ~nocache_pagemask)
+
+/* Index of the first mapping that ends above addr */
+static int nocache_map_find(uintptr_t addr)
+{
+	int lo = 0, hi = nocache_nmaps, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (nocache_maps[mid].hi <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void nocache_map_insert(const struct nocache_map *map)
+{
+	int i = nocache_map_find(map->lo);
+
+	memmove(&nocache_maps[i + 1], &nocache_maps[i], (nocache_nmaps - i) * sizeof *nocache_maps);
+	nocache_maps[i] = *map;
+	nocache_nmaps++;
+}
+
+static void nocache_map_remove(int i)
+{
+	nocache_nmaps--;
+	memmove(&nocache_maps[i], &nocache_maps[i + 1], (nocache_nmaps - i) * sizeof *nocache_maps);
+}
+
+/* Age counts of a mapping whose bounds change start over */
+static void nocache_map_age_free(struct nocache_map *map)
+{
+	if (map->age == NULL)
+		return;
+	libc_munmap(map->age, map->nage * sizeof *map->age);
+	map->age = NULL;
+	map->nage = 0;
+}
+
+/* The program closed or replaced a descriptor it did not open, e.g. in a close-all loop */
+static void nocache_map_forget(int fd)
+{
+	int i;
+
+	if (fd < 0 || fd >= nocache_nfds || (nocache_fds[fd].flags & NOCACHE_FD_MAP) == 0)
+		return;
+	pthread_mutex_lock(&nocache_maps_lock);
+	for (i = 0; i < nocache_nmaps; i++)
+		if (nocache_maps[i].fd == fd)
+			nocache_maps[i].fd = -1;
+	pthread_mutex_unlock(&nocache_maps_lock);
+	nocache_budget_drop(fd);
+	if (__atomic_load_n(&nocache_syncs, __ATOMIC_ACQUIRE) == NULL)
+		return;
+	pthread_mutex_lock(&nocache_sync_lock);
+	for (i = 0; i < nocache_nsyncs; i++)
+		if (nocache_syncs[i].fd == fd)
+			nocache_syncs[i].fd = -1;
+	pthread_mutex_unlock(&nocache_sync_lock);
+}
+
+/* Evict the file range behind [lo, hi) of map, unless its descriptor was closed and reused behind our back */
+static void nocache_map_evict(const struct nocache_map *map, uintptr_t lo, uintptr_t hi)
+{
+	struct nocache_adv adv[1];
+	struct stat st;
+	int n = 0;
+
+	if (map->fd < 0 || fstat(map->fd, &st) != 0 || st.st_dev != map->dev || st.st_ino != map->ino)
+		return;
+	nocache_adv_evict(adv, &n, map->off + (off_t)(lo - map->lo), map->off + (off_t)(hi - map->lo));
+	nocache_adv_do(map->fd, adv->lo, adv->hi, adv->advice, "posix_fadvise(POSIX_FADV_DONTNEED) of a mapping");
+}
+
+/* As nocache_map_evict() once the worker has waited for writeback of the range, the caller never blocks */
+static void nocache_map_settle(const struct nocache_map *map, uintptr_t lo, uintptr_t hi)
+{
+	struct nocache_adv adv;
+	struct stat st;
+
+	if (map->fd < 0 || fstat(map->fd, &st) != 0 || st.st_dev != map->dev || st.st_ino != map->ino)
+		return;
+	adv.lo = map->off + (off_t)(lo - map->lo);
+	adv.hi = map->off + (off_t)(hi - map->lo);
+	adv.advice = NOCACHE_ADV_SETTLE;
+	if (map->fd < nocache_nfds && nocache_worker_start() && nocache_q_push(map->fd, &adv) == 0) {
+		NOCACHE_STAT(msync_deferred, 1);
+		nocache_q_wake();
+		return;
+	}
+	NOCACHE_STAT(queue_full, 1);
+	/* Start writeback and drop what is clean already, dirty pages wait for munmap() or the next msync() */
+	nocache_adv_do(map->fd, adv.lo, adv.hi, NOCACHE_ADV_WRITE, "sync_file_range() of a mapping");
+	nocache_adv_do(map->fd, adv.lo, adv.hi, POSIX_FADV_DONTNEED, "posix_fadvise(POSIX_FADV_DONTNEED) of a mapping");
+}
+
+/*
+ * NOCACHE_MAP_COLD=<ms>: mappings a program keeps for its whole life never
+ * reach munmap(), so a helper thread walks the recorded file mappings at
+ * that interval and counts the resident pages of every 2M chunk with
+ * mincore().  A chunk that gained none since the last walk is idle and gets
+ * MADV_COLD once until it grows again.  Residency that merely holds steady
+ * is also what a fully resident chunk in constant use shows, so while
+ * NOCACHE_PSI reports pressure MADV_PAGEOUT waits until the count drops
+ * (reclaim found the pages inactive after MADV_COLD) or stayed put for
+ * NOCACHE_MAP_COLD_WALKS walks under pressure, and a chunk that refaults
+ * after a pageout only gets MADV_COLD from then on.  Private writable
+ * mappings, mappings given MADV_WILLNEED and hot files are left alone.  The map lock is dropped every
+ * NOCACHE_MAP_COLD_BATCH chunks so mmap() and munmap() are not held up.
+ */
+static int nocache_map_age_alloc(struct nocache_map *map)
+{
+	size_t n = (map->hi - map->lo + NOCACHE_MAP_COLD_CHUNK - 1) / NOCACHE_MAP_COLD_CHUNK;
+	void *ptr;
+
+	ptr = libc_mmap(NULL, n * sizeof *map->age, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return 0;
+	map->age = ptr;
+	map->nage = n;
+	return 1;
+}
+
+/* Age chunk j of map, which spans [a, b) */
+static void nocache_map_age(struct nocache_map *map, size_t j, uintptr_t a, uintptr_t b, int pressure)
+{
+	unsigned char vec[NOCACHE_MAP_COLD_CHUNK / 4096];
+	size_t k, n = (b - a + nocache_pagemask) / (nocache_pagemask + 1), count = 0;
+	uint16_t age = map->age[j];
+	int advice, dropped;
+
+	if (mincore((void *)a, b - a, vec) != 0)
+		return;
+	for (k = 0; k < n; k++)
+		count += vec[k] & 1;
+	/* Gone after a pageout stays marked so refaulting can be told, gone by itself starts over */
+	if (count == 0) {
+		map->age[j] = (age & NOCACHE_AGE_OUT) != 0 ? age & (NOCACHE_AGE_OUT|NOCACHE_AGE_HOT) : 0;
+		return;
+	}
+	if (count > (age & NOCACHE_AGE_COUNT)) {
+		/* Growing back after a pageout means the pages are in use */
+		map->age[j] = count | (age & NOCACHE_AGE_HOT) | ((age & NOCACHE_AGE_OUT) != 0 ? NOCACHE_AGE_HOT : 0);
+		return;
+	}
+	if (!pressure)
+		age &= ~NOCACHE_AGE_IDLE;
+	else if ((age & NOCACHE_AGE_IDLE) != NOCACHE_AGE_IDLE)
+		age += NOCACHE_AGE_IDLE_ONE;
+	dropped = count < (age & NOCACHE_AGE_COUNT);
+	age = count | (age & ~NOCACHE_AGE_COUNT);
+	if ((age & NOCACHE_AGE_COLD) == 0)
+		advice = MADV_COLD;
+	else if (pressure && (age & (NOCACHE_AGE_OUT|NOCACHE_AGE_HOT)) == 0
+	&& (dropped || (age & NOCACHE_AGE_IDLE) >= NOCACHE_MAP_COLD_WALKS * NOCACHE_AGE_IDLE_ONE))
+		advice = MADV_PAGEOUT;
+	else
+		advice = -1;
+	/* Failures are not retried either, mlock()ed ranges refuse both for good */
+	if (advice == MADV_PAGEOUT) {
+		age |= NOCACHE_AGE_COLD|NOCACHE_AGE_OUT;
+		if (libc_madvise((void *)a, b - a, advice) == 0)
+			NOCACHE_STAT(map_pageout, 1);
+	} else if (advice == MADV_COLD) {
+		age |= NOCACHE_AGE_COLD;
+		if (libc_madvise((void *)a, b - a, advice) == 0)
+			NOCACHE_STAT(map_cold, 1);
+	}
+	map->age[j] = age;
+}
+
+static void nocache_map_cold_tick(void)
+{
+	struct nocache_map *map;
+	uintptr_t cur = 0, a, b;
+	size_t j;
+	int i, batch, pressure, more;
+
+	if (NOCACHE_CONF()->off)
+		return;
+	pressure = nocache_psi_fd >= 0 && nocache_psi_evict();
+	do {
+		pthread_mutex_lock(&nocache_maps_lock);
+		batch = NOCACHE_MAP_COLD_BATCH;
+		for (i = nocache_map_find(cur); i < nocache_nmaps && batch > 0; i++) {
+			map = &nocache_maps[i];
+			a = cur > map->lo ? cur : map->lo;
+			cur = map->hi;
+			if ((map->flags & (NOCACHE_MAP_WRITE|NOCACHE_MAP_WILLNEED)) != 0
+			|| (nocache_hot != NULL && nocache_hot_test(map->dev, map->ino))
+			|| (map->age == NULL && !nocache_map_age_alloc(map)))
+				continue;
+			for (j = (a - map->lo) / NOCACHE_MAP_COLD_CHUNK; j < map->nage && batch > 0; j++, batch--) {
+				a = map->lo + j * NOCACHE_MAP_COLD_CHUNK;
+				b = a + NOCACHE_MAP_COLD_CHUNK < map->hi ? a + NOCACHE_MAP_COLD_CHUNK : map->hi;
+				nocache_map_age(map, j, a, b, pressure);
+			}
+			if (j < map->nage) {
+				cur = map->lo + j * NOCACHE_MAP_COLD_CHUNK;
+				break;
+			}
+		}
+		more = i < nocache_nmaps;
+		pthread_mutex_unlock(&nocache_maps_lock);
+	} while (more);
+}
+
+static void *nocache_map_cold_thread(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	ts.tv_sec = nocache_map_cold_ms / 1000;
+	ts.tv_nsec = (nocache_map_cold_ms % 1000) * 1000000;
+	for (;;) {
+		nanosleep(&ts, NULL);
+		nocache_map_cold_tick();
+	}
+	return NULL;
+}
+
+static void nocache_map_cold_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	int state = 0;
+
+	if (nocache_map_cold_ms == 0
+	|| __atomic_load_n(&nocache_map_cold_state, __ATOMIC_RELAXED) != 0
+	|| !__atomic_compare_exchange_n(&nocache_map_cold_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&tid, &attr, nocache_map_cold_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void nocache_map_add(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	struct nocache_map map;
+	struct stat st;
+
+	if (nocache_maps == NULL || length == 0 || fstat(fd, &st) != 0
+	|| (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)))
+		return;
+	map.lo = (uintptr_t)addr;
+	map.hi = map.lo + NOCACHE_MAP_LEN(length);
+	map.off = offset;
+	map.dev = st.st_dev;
+	map.ino = st.st_ino;
+	map.flags = 0;
+	map.age = NULL;
+	map.nage = 0;
+	if ((flags & MAP_PRIVATE) != 0)
+		map.flags |= NOCACHE_MAP_PRIVATE | ((prot & PROT_WRITE) != 0 ? NOCACHE_MAP_WRITE : 0);
+	if (nocache_nmaps >= nocache_maps_max)
+		return;
+	nocache_hot_touch(map.dev, map.ino);
+	map.fd = nocache_map_dup(fd, map.dev, map.ino);
+	if (map.fd < 0)
+		return;
+	nocache_map_insert(&map);
+	nocache_map_cold_start();
+}
+
+/* [lo, hi) is no longer mapped: evict what it covered and trim the table, the caller holds the lock */
+static void nocache_map_release(uintptr_t lo, uintptr_t hi, int evict)
+{
+	struct nocache_map *map, tail;
+	uintptr_t a, b;
+	int i;
+
+	for (i = nocache_map_find(lo); i < nocache_nmaps && nocache_maps[i].lo < hi; ) {
+		map = &nocache_maps[i];
+		a = lo > map->lo ? lo : map->lo;
+		b = hi < map->hi ? hi : map->hi;
+		if (evict)
+			nocache_map_evict(map, a, b);
+		nocache_map_age_free(map);
+		if (a > map->lo && b < map->hi) {
+			tail = *map;
+			tail.off += b - map->lo;
+			tail.lo = b;
+			map->hi = a;
+			if (nocache_nmaps < nocache_maps_max && map->fd >= 0
+			&& (tail.fd = nocache_map_dup(map->fd, map->dev, map->ino)) >= 0)
+				nocache_map_insert(&tail);
+			break;
+		} else if (a > map->lo) {
+			map->hi = a;
+			i++;
+		} else if (b < map->hi) {
+			map->off += b - map->lo;
+			map->lo = b;
+			i++;
+		} else {
+			nocache_map_close(map->fd);
+			nocache_map_remove(i);
+		}
+	}
+}
+
+/*
+ * Zap [lo, hi) where that cannot lose private modifications and the program
+ * has not asked for the pages with MADV_WILLNEED or MADV_SEQUENTIAL, then
+ * evict the file range behind it.
+ */
+static void nocache_map_drop(uintptr_t lo, uintptr_t hi)
+{
+	struct nocache_map *map;
+	uintptr_t a, b;
+	int i;
+
+	COND_ASSIGN_DLSYM_OR_DIE(madvise);
+	for (i = nocache_map_find(lo); i < nocache_nmaps && nocache_maps[i].lo < hi; i++) {
+		map = &nocache_maps[i];
+		if ((map->flags & (NOCACHE_MAP_WRITE|NOCACHE_MAP_WILLNEED)) != 0)
+			continue;
+		a = lo > map->lo ? lo : map->lo;
+		b = hi < map->hi ? hi : map->hi;
+		if (libc_madvise((void *)a, b - a, MADV_DONTNEED) != 0)
+			DEBUG_PERROR("madvise(MADV_DONTNEED) of a mapping");
+		else
+			nocache_map_evict(map, a, b);
+	}
+}
+
+/*
+ * msync() has written [lo, hi) back or started to: evict the file range
+ * behind it now or once written back, leaving the mappings and the pages
+ * still mapped in place until munmap().  Mappings the program wants read
+ * ahead keep their range.
+ */
+static void nocache_map_sync(uintptr_t lo, uintptr_t hi, int defer)
+{
+	struct nocache_map *map;
+	uintptr_t a, b;
+	int i;
+
+	for (i = nocache_map_find(lo); i < nocache_nmaps && nocache_maps[i].lo < hi; i++) {
+		map = &nocache_maps[i];
+		if ((map->flags & NOCACHE_MAP_WILLNEED) != 0)
+			continue;
+		a = lo > map->lo ? lo : map->lo;
+		b = hi < map->hi ? hi : map->hi;
+		if (defer)
+			nocache_map_settle(map, a, b);
+		else
+			nocache_map_evict(map, a, b);
+	}
+}
+
+/*
+ * Batched durability for FORCE_SYNC builds: rather than fdatasync() inside
+ * every close(), a regular file closed after being opened for writing is
+ * held on a duplicate descriptor until NOCACHE_SYNC_WINDOW ms pass (default
+ * 1000), NOCACHE_SYNC_FILES are waiting (default 64) or the process exits.
+ * Then one syncfs() per filesystem makes the batch durable, and with its
+ * pages clean DONTNEED really drops them.  A window of 0 syncs every close().
+ */
+static void nocache_sync_flush(void)
+{
+	struct nocache_sync *batch, *s;
+	int i, j, n;
+
+	pthread_mutex_lock(&nocache_sync_flush_lock);
+	pthread_mutex_lock(&nocache_sync_lock);
+	batch = nocache_syncs;
+	n = nocache_nsyncs;
+	nocache_syncs = nocache_syncs_spare;
+	nocache_syncs_spare = batch;
+	nocache_nsyncs = 0;
+	pthread_mutex_unlock(&nocache_sync_lock);
+	for (i = 0; i < n; i++) {
+		s = &batch[i];
+		for (j = 0; j < i && batch[j].dev != s->dev; j++)
+			;
+		if (s->fd < 0 || j < i || syncfs(s->fd) == 0)
+			continue;
+		DEBUG_PERROR("syncfs() of closed files");
+		/* Same filesystem further on is covered by the dev match above, sync those one by one */
+		for (j = i; j < n; j++)
+			if (batch[j].fd >= 0 && batch[j].dev == s->dev)
+				COND_CALL_SYNC(SYNC_CALL, batch[j].fd, " of a closed file");
+	}
+	for (i = 0; i < n; i++) {
+		if (batch[i].fd < 0)
+			continue;
+		if (nocache_dontneed(batch[i].fd, 0, 0) != 0)
+			DEBUG_PERROR("posix_fadvise(POSIX_FADV_DONTNEED) of a closed file");
+		nocache_map_close(batch[i].fd);
+	}
+	pthread_mutex_unlock(&nocache_sync_flush_lock);
+}
+
+static void *nocache_sync_thread(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	ts.tv_sec = nocache_sync_ms / 1000;
+	ts.tv_nsec = (nocache_sync_ms % 1000) * 1000000;
+	for (;;) {
+		nanosleep(&ts, NULL);
+		if (__atomic_load_n(&nocache_nsyncs, __ATOMIC_RELAXED) != 0)
+			nocache_sync_flush();
+	}
+	return NULL;
+}
+
+/* The parent still holds the batch, the child only drops its copies of the descriptors */
+static void nocache_sync_fork(void)
+{
+	int i, fd;
+
+	for (i = 0; i < nocache_nsyncs; i++) {
+		if ((fd = nocache_syncs[i].fd) < 0)
+			continue;
+		/* Not nocache_map_close(), the worker queue may not be reset yet */
+		if (fd < nocache_nfds)
+			nocache_fds[fd].flags = 0;
+		nocache_keep_release(fd);
+		libc_close(fd);
+	}
+	nocache_nsyncs = 0;
+	nocache_sync_state = 0;
+}
+
+static int nocache_sync_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+	void *ptr;
+	int state = 0, ret;
+
+	if (!__atomic_compare_exchange_n(&nocache_sync_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return state == 2;
+	if (nocache_syncs == NULL) {
+		COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+		ptr = libc_mmap(NULL, 2 * nocache_syncs_max * sizeof *nocache_syncs, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		nocache_syncs_spare = (struct nocache_sync *)ptr + nocache_syncs_max;
+		__atomic_store_n(&nocache_syncs, ptr, __ATOMIC_RELEASE);
+		pthread_atfork(NULL, NULL, nocache_sync_fork);
+	}
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&tid, &attr, nocache_sync_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+		goto fail;
+	__atomic_store_n(&nocache_sync_state, 2, __ATOMIC_RELEASE);
+	return 1;
+fail:
+	__atomic_store_n(&nocache_sync_state, -1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Whether close() may skip its own sync because fd joined the batch */
+static int nocache_sync_defer(int fd)
+{
+	struct stat st;
+	int fl, dup;
+
+	if (nocache_syncs_max == 0 || fd < 0 || (fd < nocache_nfds && (nocache_fds[fd].flags & NOCACHE_FD_MAP) != 0)
+	|| fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+	|| (fl = fcntl(fd, F_GETFL)) < 0 || (fl & O_ACCMODE) == O_RDONLY || !nocache_sync_start())
+		return 0;
+	dup = nocache_map_dup(fd, st.st_dev, st.st_ino);
+	if (dup < 0)
+		return 0;
+	pthread_mutex_lock(&nocache_sync_lock);
+	while (nocache_nsyncs >= nocache_syncs_max) {
+		pthread_mutex_unlock(&nocache_sync_lock);
+		nocache_sync_flush();
+		pthread_mutex_lock(&nocache_sync_lock);
+	}
+	nocache_syncs[nocache_nsyncs].fd = dup;
+	nocache_syncs[nocache_nsyncs].dev = st.st_dev;
+	nocache_nsyncs++;
+	pthread_mutex_unlock(&nocache_sync_lock);
+	return 1;
+}
+
+/* A private mapping made writable may hold data that exists nowhere else */
+static void nocache_map_protect(uintptr_t lo, uintptr_t hi)
+{
+	int i;
+
+	for (i = nocache_map_find(lo); i < nocache_nmaps && nocache_maps[i].lo < hi; i++)
+		if ((nocache_maps[i].flags & NOCACHE_MAP_PRIVATE) != 0)
+			nocache_maps[i].flags |= NOCACHE_MAP_WRITE;
+}
+
+/*
+ * Direct mode: the first transfer of at least NOCACHE_DIRECT_MIN bytes
+ * through a descriptor whose path matched a "direct" rule switches it to
+ * O_DIRECT.  Aligned requests go straight to the kernel.  Otherwise the
+ * partial blocks at either end go through the page cache and the whole
+ * blocks between them are staged through a per-thread bounce buffer of
+ * NOCACHE_DIRECT_CHUNK bytes, rounded down to the block size.  Whatever the
+ * kernel refuses falls back to buffered I/O for good.
+ */
+static void nocache_direct_lock(struct nocache_fd *nf)
+{
+	while (!nocache_fd_trylock(nf))
+		sched_yield();
+}
+
+static void nocache_direct_off(int fd, struct nocache_fd *nf)
+{
+	int fl = fcntl(fd, F_GETFL);
+
+	if (fl >= 0)
+		fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+	nf->direct = 0;
+	nf->policy = NOCACHE_POLICY_BEHIND;
+	NOCACHE_STAT(direct_fallback, 1);
+}
+
+/* Table entry of fd when a transfer of count bytes should take the direct path */
+static struct nocache_fd *nocache_direct_fd(int fd, size_t count)
+{
+	struct nocache_fd *nf;
+	int fl;
+
+	nf = nocache_fd_get(fd);
+	if (nf == NULL || (__atomic_load_n(&nf->flags, __ATOMIC_ACQUIRE) & (NOCACHE_FD_SKIP|NOCACHE_FD_APPEND)) != 0)
+		return NULL;
+	if (nf->direct)
+		return nf;
+	if (nf->policy != NOCACHE_POLICY_DIRECT || count < nocache_direct_min)
+		return NULL;
+	nocache_direct_lock(nf);
+	if (!nf->direct && nf->policy == NOCACHE_POLICY_DIRECT) {
+		nocache_direct_align(fd, nf);
+		fl = fcntl(fd, F_GETFL);
+		if (!nf->direct || fl < 0 || (fl & O_APPEND) != 0 || fcntl(fd, F_SETFL, fl | O_DIRECT) != 0) {
+			nf->direct = 0;
+			nf->policy = NOCACHE_POLICY_BEHIND;
+		}
+	}
+	nocache_fd_unlock(nf);
+	return nf->direct ? nf : NULL;
+}
+
+static void *nocache_direct_buf(void)
+{
+	void *buf = pthread_getspecific(nocache_direct_key);
+
+	if (buf != NULL)
+		return buf;
+	buf = libc_mmap(NULL, nocache_direct_chunk, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+	pthread_setspecific(nocache_direct_key, buf);
+	return buf;
+}
+
+/* Copy len bytes between buf and the iovec, starting skip bytes into it */
+static void nocache_iov_copy(const struct iovec *iov, int iovcnt, size_t skip, char *buf, size_t len, int how)
+{
+	size_t n;
+
+	for (; iovcnt > 0 && len > 0; iov++, iovcnt--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+		n = iov->iov_len - skip < len ? iov->iov_len - skip : len;
+		if (how == NOCACHE_IO_WRITE)
+			memcpy(buf, (char *)iov->iov_base + skip, n);
+		else
+			memcpy((char *)iov->iov_base + skip, buf, n);
+		buf += n;
+		len -= n;
+		skip = 0;
+	}
+}
+
+static size_t nocache_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static int nocache_iov_aligned(const struct iovec *iov, int iovcnt, off_t off, uintptr_t mask)
+{
+	int i;
+
+	if (((uintptr_t)off & mask) != 0)
+		return 0;
+	for (i = 0; i < iovcnt; i++)
+		if ((((uintptr_t)iov[i].iov_base | iov[i].iov_len) & mask) != 0)
+			return 0;
+	return 1;
+}
+
+/*
+ * Move len bytes at off through the page cache, with O_DIRECT dropped from
+ * the description for the call, then write them back and evict them.  The
+ * partial blocks at either end of an unaligned request go this way: merging
+ * them into a bounce block would overwrite what other writers put there.
+ */
+static ssize_t nocache_direct_buffered(int fd, char *buf, size_t len, off_t off, int how)
+{
+	ssize_t ret = -1;
+	off_t lo, hi;
+	int fl, i, error;
+
+	fl = fcntl(fd, F_GETFL);
+	if (fl < 0)
+		return -1;
+	/* Another user of the description may put O_DIRECT back in between */
+	for (i = 0; i < 3; i++) {
+		if (fcntl(fd, F_SETFL, fl & ~O_DIRECT) != 0)
+			break;
+		ret = how == NOCACHE_IO_READ ? libc_pread(fd, buf, len, off) : libc_pwrite(fd, buf, len, off);
+		if (ret >= 0 || errno != EINVAL)
+			break;
+	}
+	error = errno;
+	fcntl(fd, F_SETFL, fl | O_DIRECT);
+	if (ret > 0) {
+		if (how == NOCACHE_IO_WRITE)
+			nocache_sync_range(fd, off, ret,
+				SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+		/* Whole pages, or the partial ones at the edges would stay */
+		lo = off & ~(off_t)nocache_pagemask;
+		hi = (off + ret + (off_t)nocache_pagemask) & ~(off_t)nocache_pagemask;
+		nocache_fadvise(fd, lo, hi - lo, POSIX_FADV_DONTNEED);
+	}
+	errno = error;
+	return ret;
+}
+
+/* Unaligned head and tail through the page cache, the aligned middle bounced in whole blocks */
+static ssize_t nocache_direct_bounce(int fd, struct nocache_fd *nf, const struct iovec *iov, int iovcnt,
+	size_t total, off_t pos, int how)
+{
+	char *buf;
+	size_t done = 0, n, chunk;
+	off_t mask = nf->dalign - 1, at, tail;
+	ssize_t ret = 0;
+	int bounce;
+
+	chunk = nocache_direct_chunk - nocache_direct_chunk % nf->dalign;
+	if (chunk == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	buf = nocache_direct_buf();
+	if (buf == NULL)
+		return -1;
+	tail = (pos + (off_t)total) & ~mask;
+	while (done < total) {
+		at = pos + (off_t)done;
+		bounce = (at & mask) == 0 && at < tail;
+		if (bounce)
+			n = (size_t)(tail - at) < chunk ? (size_t)(tail - at) : chunk;
+		else if ((at & mask) != 0 && (size_t)(nf->dalign - (at & mask)) < total - done)
+			n = nf->dalign - (at & mask);
+		else
+			n = total - done;
+		if (how == NOCACHE_IO_WRITE)
+			nocache_iov_copy(iov, iovcnt, done, buf, n, how);
+		if (!bounce)
+			ret = nocache_direct_buffered(fd, buf, n, at, how);
+		else if (how == NOCACHE_IO_READ)
+			ret = libc_pread(fd, buf, n, at);
+		else
+			ret = libc_pwrite(fd, buf, n, at);
+		if (ret < 0)
+			break;
+		if (bounce)
+			NOCACHE_STAT(direct_bounced, ret);
+		if (how == NOCACHE_IO_READ)
+			nocache_iov_copy(iov, iovcnt, done, buf, ret, how);
+		done += ret;
+		if ((size_t)ret < n)
+			break;
+	}
+	return done != 0 || ret >= 0 ? (ssize_t)done : -1;
+}
+
+static ssize_t nocache_direct_io(int fd, struct nocache_fd *nf, const struct iovec *iov, int iovcnt, off_t off, int how)
+{
+	size_t total = nocache_iov_len(iov, iovcnt);
+	ssize_t ret;
+	off_t pos = off;
+
+	COND_ASSIGN_DLSYM64_OR_DIE(lseek, lseek64);
+	COND_ASSIGN_DLSYM64_OR_DIE(pread, pread64);
+	COND_ASSIGN_DLSYM64_OR_DIE(pwrite, pwrite64);
+	COND_ASSIGN_DLSYM64_OR_DIE(preadv, preadv64);
+	COND_ASSIGN_DLSYM64_OR_DIE(pwritev, pwritev64);
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	nocache_direct_lock(nf);
+	if (!nf->direct) {
+		nocache_fd_unlock(nf);
+		return NOCACHE_DIRECT_FALLBACK;
+	}
+	/* dup() and fork() share the file position, so it is never taken from nf->pos here */
+	if (off < 0) {
+		pos = libc_lseek(fd, 0, SEEK_CUR);
+		if (pos < 0) {
+			nocache_direct_off(fd, nf);
+			nocache_fd_unlock(nf);
+			return NOCACHE_DIRECT_FALLBACK;
+		}
+	}
+	NOCACHE_STAT(direct, 1);
+	for (;;) {
+		if (nocache_iov_aligned(iov, iovcnt, pos, nf->dalign - 1))
+			ret = how == NOCACHE_IO_READ ? libc_preadv(fd, iov, iovcnt, pos) : libc_pwritev(fd, iov, iovcnt, pos);
+		else
+			ret = nocache_direct_bounce(fd, nf, iov, iovcnt, total, pos, how);
+		if (ret >= 0 || errno != EINVAL)
+			break;
+		/* Alignment guessed too small */
+		if (errno == EINVAL && nf->dalign < nocache_pagemask + 1) {
+			nf->dalign = nocache_pagemask + 1;
+			continue;
+		}
+		nocache_direct_off(fd, nf);
+		nocache_fd_unlock(nf);
+		return NOCACHE_DIRECT_FALLBACK;
+	}
+	if (off < 0 && ret > 0) {
+		libc_lseek(fd, pos + ret, SEEK_SET);
+		__atomic_and_fetch(&nf->flags, ~NOCACHE_FD_POS, __ATOMIC_RELAXED);
+	}
+	nocache_fd_unlock(nf);
+	if (ret > 0 && how == NOCACHE_IO_WRITE)
+		NOCACHE_STAT(bytes_written, ret);
+	else if (ret > 0)
+		NOCACHE_STAT(bytes_read, ret);
+	return ret;
+}
+
+/* Drop direct mode from either descriptor after the kernel refused a transfer it could not align */
+static int nocache_direct_refused(int fd_in, int fd_out)
+{
+	struct nocache_fd *nf;
+	int fds[2] = { fd_in, fd_out }, i, ret = 0;
+
+	if (!nocache_direct || errno != EINVAL)
+		return 0;
+	for (i = 0; i < 2; i++) {
+		nf = nocache_fd_get(fds[i]);
+		if (nf == NULL || !nf->direct)
+			continue;
+		nocache_direct_lock(nf);
+		if (nf->direct) {
+			nocache_direct_off(fds[i], nf);
+			ret = 1;
+		}
+		nocache_fd_unlock(nf);
+	}
+	return ret;
+}
+
+/* Serve the call from the direct path and return, unless fd is not in direct mode */
+#define NOCACHE_DIRECT_IO(fd, iov, iovcnt, count, off, how)				\
+	do {										\
+		struct nocache_fd *dnf;							\
+		ssize_t dret;								\
+		if (nocache_direct && (dnf = nocache_direct_fd(fd, count)) != NULL	\
+		&& (dret = nocache_direct_io(fd, dnf, iov, iovcnt, off, how)) != NOCACHE_DIRECT_FALLBACK)	\
+			return dret;							\
+	} while (0)
+
+/*
+ * Stdio reads and writes through glibc-internal calls, in buffer sized
+ * chunks the other hooks never see.  Every NOCACHE_BATCH bytes moved
+ * through a stream the descriptor position is looked up once, and what
+ * lies between it and the previous lookup is fed to nocache_fd_io().
+ */
+/* Called with the descriptor lock held, which it releases */
+static void nocache_stdio_sync(int fd, struct nocache_fd *nf, int how)
+{
+	off_t lo = nf->sio, pos;
+
+	__atomic_store_n(&nf->sio_count, 0, __ATOMIC_RELAXED);
+	COND_ASSIGN_DLSYM64_OR_DIE(lseek, lseek64);
+	pos = libc_lseek(fd, 0, SEEK_CUR);
+	if (pos >= 0)
+		nf->sio = pos;
+	nocache_fd_unlock(nf);
+	if (pos > lo)
+		nocache_fd_range(fd, lo, pos - lo, how, NULL);
+}
+
+static void nocache_stdio(FILE *stream, size_t count, int how)
+{
+	struct nocache_fd *nf;
+	unsigned char flags;
+	int fd, error;
+
+	NOCACHE_STAT(stdio, 1);
+	if (count == 0 || stream == NULL)
+		return;
+	if (how == NOCACHE_IO_WRITE)
+		NOCACHE_STAT(bytes_written, count);
+	else
+		NOCACHE_STAT(bytes_read, count);
+	fd = fileno(stream);
+	nf = nocache_fd_get(fd);
+	if (nf == NULL)
+		return;
+	flags = __atomic_load_n(&nf->flags, __ATOMIC_RELAXED);
+	if ((flags & NOCACHE_FD_SKIP) != 0)
+		return;
+	if ((flags & NOCACHE_FD_STDIO) == 0) {
+		__atomic_and_fetch(&nf->flags, (unsigned char)~NOCACHE_FD_POS, __ATOMIC_RELAXED);
+		__atomic_or_fetch(&nf->flags, NOCACHE_FD_STDIO, __ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&nf->sio_count, count, __ATOMIC_RELAXED) < nocache_batch
+	|| !nocache_fd_trylock(nf))
+		return;
+	error = errno;
+	nocache_stdio_sync(fd, nf, how);
+	errno = error;
+}
+
+/* Push out buffered output and account everything up to the descriptor position before it goes away */
+static void nocache_stdio_close(FILE *stream, int closing)
+{
+	struct nocache_fd *nf;
+	int fd, how = NOCACHE_IO_READ, error = errno;
+
+	fd = fileno(stream);
+	nf = nocache_fd_get(fd);
+	if (nf == NULL || (nf->flags & NOCACHE_FD_SKIP) != 0)
+		return;
+	if (__fwriting(stream)) {
+		fflush(stream);
+		how = NOCACHE_IO_WRITE;
+	}
+	if (nocache_fd_trylock(nf))
+		nocache_stdio_sync(fd, nf, how);
+	if (closing) {
+		nocache_fd_flush(fd, 1, "posix_fadvise(POSIX_FADV_DONTNEED) inside fclose()");
+		nocache_worker_wait(fd);
+		nocache_keep_release(fd);
+	}
+	errno = error;
+}
+
+/* Descriptors still open at exit, such as stdout or a dup2() target, keep their pending ranges until here */
+void __attribute__((destructor)) nocache_fini(void)
+{
+	struct nocache_fd *nf;
+	int fd, hi;
+
+	nocache_exiting = 1;
+	/* exit() flushes streams only after the destructors, stdout written by printf() included */
+	fflush(NULL);
+	for (fd = 0; fd <= 2 || fd <= nocache_fdhi; fd++) {
+		nf = fd <= 2 ? nocache_fd_get(fd) : &nocache_fds[fd];
+		if (nf == NULL || (nf->flags & (NOCACHE_FD_SEEN|NOCACHE_FD_SKIP)) != NOCACHE_FD_SEEN
+		|| (fd > 2 && (nf->flags & NOCACHE_FD_STDIO) == 0) || !nocache_fd_trylock(nf))
+			continue;
+		nocache_stdio_sync(fd, nf, fd == 0 ? NOCACHE_IO_READ : NOCACHE_IO_WRITE);
+	}
+	hi = __atomic_load_n(&nocache_fdhi, __ATOMIC_RELAXED);
+	for (fd = 0; fd <= hi; fd++)
+		if ((nocache_fds[fd].flags & NOCACHE_FD_SEEN) != 0)
+			nocache_fd_flush(fd, 0, NULL);
+	if (nocache_age_ns != 0)
+		nocache_age_expire(UINT64_MAX);
+	for (fd = 0; fd <= hi; fd++)
+		nocache_worker_wait(fd);
+	if (nocache_nmaps != 0) {
+		pthread_mutex_lock(&nocache_maps_lock);
+		nocache_map_drop(0, UINTPTR_MAX);
+		pthread_mutex_unlock(&nocache_maps_lock);
+	}
+	if (nocache_syncs != NULL)
+		nocache_sync_flush();
+	nocache_stats_dump();
+	if (nocache_stats_seg != NULL)
+		shm_unlink(nocache_stats_shm);
+}
+
+int open(const char *pathname, int flags, ...)
+{
+	va_list ap;
+	int fd;
+	mode_t mode = 0;
+
+	va_start(ap, flags);
+	if ((flags & O_CREAT) != 0)
+		mode = va_arg(ap, mode_t);
+	va_end(ap);
+	NOCACHE_STAT(open, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(open, open64);
+	fd = libc_open(pathname, flags, mode);
+	if (fd >= 0)
+		nocache_fd_open(fd, pathname, flags);
+	return fd;
+}
+NOCACHE_ALIAS64(open, open64);
+
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+	va_list ap;
+	int fd;
+	mode_t mode = 0;
+
+	va_start(ap, flags);
+	if ((flags & O_CREAT) != 0)
+		mode = va_arg(ap, mode_t);
+	va_end(ap);
+	NOCACHE_STAT(openat, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(openat, openat64);
+	fd = libc_openat(dirfd, pathname, flags, mode);
+	if (fd >= 0)
+		nocache_fd_open(fd, pathname, flags);
+	return fd;
+}
+NOCACHE_ALIAS64(openat, openat64);
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	ssize_t ret;
+
+	NOCACHE_STAT(read, 1);
+	NOCACHE_DIRECT_IO(fd, &iov, 1, count, NOCACHE_OFF_CUR, NOCACHE_IO_READ);
+	COND_ASSIGN_DLSYM_OR_DIE(read);
+	ret = libc_read(fd, buf, count);
+	if (ret > 0)
+		nocache_fd_io(fd, NOCACHE_OFF_CUR, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside read()");
+	return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	struct iovec iov = { (void *)buf, count };
+	ssize_t ret;
+
+	NOCACHE_STAT(write, 1);
+	NOCACHE_DIRECT_IO(fd, &iov, 1, count, NOCACHE_OFF_CUR, NOCACHE_IO_WRITE);
+	COND_ASSIGN_DLSYM_OR_DIE(write);
+	ret = libc_write(fd, buf, count);
+	if (ret > 0)
+		nocache_fd_io(fd, NOCACHE_OFF_CUR, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside write()");
+	return ret;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	struct iovec iov = { buf, count };
+	ssize_t ret;
+
+	NOCACHE_STAT(pread, 1);
+	if (offset >= 0)
+		NOCACHE_DIRECT_IO(fd, &iov, 1, count, offset, NOCACHE_IO_READ);
+	COND_ASSIGN_DLSYM64_OR_DIE(pread, pread64);
+	ret = libc_pread(fd, buf, count, offset);
+	if (ret > 0)
+		nocache_fd_io(fd, offset, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside pread()");
+	return ret;
+}
+NOCACHE_ALIAS64(pread, pread64);
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	struct iovec iov = { (void *)buf, count };
+	ssize_t ret;
+
+	NOCACHE_STAT(pwrite, 1);
+	if (offset >= 0)
+		NOCACHE_DIRECT_IO(fd, &iov, 1, count, offset, NOCACHE_IO_WRITE);
+	COND_ASSIGN_DLSYM64_OR_DIE(pwrite, pwrite64);
+	ret = libc_pwrite(fd, buf, count, offset);
+	if (ret > 0)
+		nocache_fd_io(fd, offset, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwrite()");
+	return ret;
+}
+NOCACHE_ALIAS64(pwrite, pwrite64);
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	NOCACHE_STAT(readv, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(readv);
+	NOCACHE_DIRECT_IO(fd, iov, iovcnt, nocache_iov_len(iov, iovcnt), NOCACHE_OFF_CUR, NOCACHE_IO_READ);
+	ret = libc_readv(fd, iov, iovcnt);
+	if (ret > 0)
+		nocache_fd_io(fd, NOCACHE_OFF_CUR, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside readv()");
+	return ret;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	NOCACHE_STAT(writev, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(writev);
+	NOCACHE_DIRECT_IO(fd, iov, iovcnt, nocache_iov_len(iov, iovcnt), NOCACHE_OFF_CUR, NOCACHE_IO_WRITE);
+	ret = libc_writev(fd, iov, iovcnt);
+	if (ret > 0)
+		nocache_fd_io(fd, NOCACHE_OFF_CUR, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside writev()");
+	return ret;
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t ret;
+
+	NOCACHE_STAT(preadv, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(preadv, preadv64);
+	if (offset >= 0)
+		NOCACHE_DIRECT_IO(fd, iov, iovcnt, nocache_iov_len(iov, iovcnt), offset, NOCACHE_IO_READ);
+	ret = libc_preadv(fd, iov, iovcnt, offset);
+	if (ret > 0)
+		nocache_fd_io(fd, offset, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside preadv()");
+	return ret;
+}
+NOCACHE_ALIAS64(preadv, preadv64);
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t ret;
+
+	NOCACHE_STAT(pwritev, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(pwritev, pwritev64);
+	if (offset >= 0)
+		NOCACHE_DIRECT_IO(fd, iov, iovcnt, nocache_iov_len(iov, iovcnt), offset, NOCACHE_IO_WRITE);
+	ret = libc_pwritev(fd, iov, iovcnt, offset);
+	if (ret > 0)
+		nocache_fd_io(fd, offset, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwritev()");
+	return ret;
+}
+NOCACHE_ALIAS64(pwritev, pwritev64);
+
+int fsync(int fd)
+{
+	int ret;
+
+	NOCACHE_STAT(fsync, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(fsync);
+	ret = libc_fsync(fd);
+	if (ret == 0)
+		nocache_fd_flush(fd, 0, "posix_fadvise(POSIX_FADV_DONTNEED) inside fsync()");
+	return ret;
+}
+
+#if _POSIX_SYNCHRONIZED_IO > 0
+int fdatasync(int fd)
+{
+	int ret;
+
+	NOCACHE_STAT(fdatasync, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(fdatasync);
+	ret = libc_fdatasync(fd);
+	if (ret == 0)
+		nocache_fd_flush(fd, 0, "posix_fadvise(POSIX_FADV_DONTNEED) inside fdatasync()");
+	return ret;
+}
+#endif
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+	off_t ret;
+
+	NOCACHE_STAT(lseek, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(lseek, lseek64);
+	ret = libc_lseek(fd, offset, whence);
+	if (ret >= 0)
+		nocache_fd_seek(fd, ret);
+	return ret;
+}
+NOCACHE_ALIAS64(lseek, lseek64);
+
+int close(int fd)
+{
+	NOCACHE_STAT(close, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(close);
+	if (!nocache_sync_defer(fd))
+		COND_CALL_SYNC(SYNC_CALL, fd, " inside close()");
+	nocache_map_forget(fd);
+	nocache_fd_flush(fd, 1, "posix_fadvise(POSIX_FADV_DONTNEED) inside close()");
+	nocache_worker_wait(fd);
+	nocache_keep_release(fd);
+	return libc_close(fd);
+}
+
+int dup2(int oldfd, int newfd)
+{
+	NOCACHE_STAT(dup2, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(dup2);
+	if (oldfd != newfd) {
+		nocache_map_forget(newfd);
+		nocache_fd_flush(newfd, 1, NULL);
+		nocache_worker_wait(newfd);
+		nocache_keep_release(newfd);
+	}
+	return libc_dup2(oldfd, newfd);
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+	NOCACHE_STAT(dup3, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(dup3);
+	if (oldfd != newfd) {
+		nocache_map_forget(newfd);
+		nocache_fd_flush(newfd, 1, NULL);
+		nocache_worker_wait(newfd);
+		nocache_keep_release(newfd);
+	}
+	return libc_dup3(oldfd, newfd, flags);
+}
+
+/* Called with the map lock held when nocache_map_locked(flags) */
+static void nocache_mmap_done(void *ptr, size_t length, int prot, int flags, int fd, off_t offset, const char *msg)
+{
+	if (nocache_maps != NULL && (flags & MAP_FIXED) != 0)
+		nocache_map_release((uintptr_t)ptr, (uintptr_t)ptr + NOCACHE_MAP_LEN(length), 1);
+	if ((flags & (MAP_ANON|MAP_ANONYMOUS)) != 0 || !nocache_fd_evictable(fd))
+		return;
+	if (prot != PROT_NONE && nocache_fd_hinted(fd))
+		NOCACHE_PERROR(fd, offset, length, msg);
+	else if (prot != PROT_NONE)
+		NOCACHE_FD_PERROR(fd, offset, length, msg);
+	nocache_map_add(ptr, length, prot, flags, fd, offset);
+}
+
+static int nocache_map_locked(int flags)
+{
+	return nocache_maps != NULL && ((flags & MAP_FIXED) != 0 || (flags & (MAP_ANON|MAP_ANONYMOUS)) == 0);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	void *ptr;
+	int locked = nocache_map_locked(flags);
+
+	NOCACHE_STAT(mmap, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(mmap, mmap64);
+	if (locked)
+		pthread_mutex_lock(&nocache_maps_lock);
+	ptr = libc_mmap(addr, length, prot, flags, fd, offset);
+	if (ptr != MAP_FAILED)
+		nocache_mmap_done(ptr, length, prot, flags, fd, offset, "posix_fadvise(POSIX_FADV_DONTNEED) inside mmap()");
+	if (locked)
+		pthread_mutex_unlock(&nocache_maps_lock);
+	return ptr;
+}
+NOCACHE_ALIAS64(mmap, mmap64);
+
+void *mmap2(void *addr, size_t length, int prot, int flags, int fd, off_t pgoffset)
+{
+	void *ptr;
+	int locked = nocache_map_locked(flags);
+
+	NOCACHE_STAT(mmap2, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(mmap2);
+	if (locked)
+		pthread_mutex_lock(&nocache_maps_lock);
+	ptr = libc_mmap2(addr, length, prot, flags, fd, pgoffset);
+	if (ptr != MAP_FAILED)
+		nocache_mmap_done(ptr, length, prot, flags, fd, pgoffset * 4096, "posix_fadvise(POSIX_FADV_DONTNEED) inside mmap2()");
+	if (locked)
+		pthread_mutex_unlock(&nocache_maps_lock);
+	return ptr;
+}
+
+int msync(void *addr, size_t length, int flags)
+{
+	int ret;
+
+	NOCACHE_STAT(msync, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(msync);
+	ret = libc_msync(addr, length, flags);
+	if (ret == 0 && nocache_maps != NULL) {
+		pthread_mutex_lock(&nocache_maps_lock);
+		nocache_map_sync((uintptr_t)addr, (uintptr_t)addr + NOCACHE_MAP_LEN(length), (flags & MS_SYNC) == 0);
+		pthread_mutex_unlock(&nocache_maps_lock);
+	}
+	return ret;
+}
+
+int munmap(void *addr, size_t length)
+{
+	int ret;
+
+	NOCACHE_STAT(munmap, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(munmap);
+	if (nocache_maps == NULL)
+		return libc_munmap(addr, length);
+	pthread_mutex_lock(&nocache_maps_lock);
+	ret = libc_munmap(addr, length);
+	if (ret == 0)
+		nocache_map_release((uintptr_t)addr, (uintptr_t)addr + NOCACHE_MAP_LEN(length), 1);
+	pthread_mutex_unlock(&nocache_maps_lock);
+	return ret;
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+	struct nocache_map map;
+	va_list ap;
+	void *ptr, *new_address = NULL;
+	uintptr_t lo = (uintptr_t)old_address;
+	int i, moved = 0;
+
+	va_start(ap, flags);
+	if ((flags & MREMAP_FIXED) != 0)
+		new_address = va_arg(ap, void *);
+	va_end(ap);
+	NOCACHE_STAT(mremap, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(mremap);
+	if (nocache_maps == NULL)
+		return libc_mremap(old_address, old_size, new_size, flags, new_address);
+	pthread_mutex_lock(&nocache_maps_lock);
+	ptr = libc_mremap(old_address, old_size, new_size, flags, new_address);
+	if (ptr != MAP_FAILED) {
+		i = nocache_map_find(lo);
+		if (i < nocache_nmaps && nocache_maps[i].lo == lo
+		&& nocache_maps[i].hi == lo + NOCACHE_MAP_LEN(old_size)) {
+			map = nocache_maps[i];
+			nocache_map_remove(i);
+			nocache_map_age_free(&map);
+			moved = 1;
+		}
+		nocache_map_release(lo, lo + NOCACHE_MAP_LEN(old_size), 1);
+		if ((flags & MREMAP_FIXED) != 0)
+			nocache_map_release((uintptr_t)ptr, (uintptr_t)ptr + NOCACHE_MAP_LEN(new_size), 1);
+		if (moved) {
+			if (NOCACHE_MAP_LEN(new_size) < map.hi - map.lo)
+				nocache_map_evict(&map, map.lo + NOCACHE_MAP_LEN(new_size), map.hi);
+			map.lo = (uintptr_t)ptr;
+			map.hi = map.lo + NOCACHE_MAP_LEN(new_size);
+			nocache_map_insert(&map);
+		}
+	}
+	pthread_mutex_unlock(&nocache_maps_lock);
+	return ptr;
+}
+
+int mprotect(void *addr, size_t len, int prot)
+{
+	int ret;
+
+	NOCACHE_STAT(mprotect, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(mprotect);
+	ret = libc_mprotect(addr, len, prot);
+	if (ret == 0 && (prot & PROT_WRITE) != 0 && nocache_nmaps != 0) {
+		pthread_mutex_lock(&nocache_maps_lock);
+		nocache_map_protect((uintptr_t)addr, (uintptr_t)addr + NOCACHE_MAP_LEN(len));
+		pthread_mutex_unlock(&nocache_maps_lock);
+	}
+	return ret;
+}
+
+/*
+ * Advice on a tracked file mapping: pages the program drops take the file
+ * range behind them along, and the range of a mapping it wants read ahead
+ * is left alone by msync() and at exit until it takes the advice back with
+ * MADV_NORMAL or MADV_RANDOM.
+ * The mark covers the whole mapping, never a part of it.
+ */
+int madvise(void *addr, size_t length, int advice)
+{
+	struct nocache_map *map;
+	uintptr_t lo = (uintptr_t)addr, hi = lo + NOCACHE_MAP_LEN(length), a, b;
+	int ret, i;
+
+	NOCACHE_STAT(madvise, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(madvise);
+	ret = libc_madvise(addr, length, advice);
+	if (ret != 0 || nocache_nmaps == 0 || (advice != MADV_DONTNEED && advice != MADV_WILLNEED
+	&& advice != MADV_SEQUENTIAL && advice != MADV_NORMAL && advice != MADV_RANDOM))
+		return ret;
+	pthread_mutex_lock(&nocache_maps_lock);
+	for (i = nocache_map_find(lo); i < nocache_nmaps && nocache_maps[i].lo < hi; i++) {
+		map = &nocache_maps[i];
+		a = lo > map->lo ? lo : map->lo;
+		b = hi < map->hi ? hi : map->hi;
+		if (advice == MADV_DONTNEED)
+			nocache_map_evict(map, a, b);
+		else if (advice == MADV_WILLNEED || advice == MADV_SEQUENTIAL)
+			map->flags |= NOCACHE_MAP_WILLNEED;
+		else
+			map->flags &= ~NOCACHE_MAP_WILLNEED;
+	}
+	pthread_mutex_unlock(&nocache_maps_lock);
+	return ret;
+}
+
+/*
+ * The program's own advice goes through untouched, after the descriptor is
+ * classified so the RANDOM issued on first sight cannot land on top of it.
+ * RANDOM, SEQUENTIAL and NORMAL are remembered for the streaming and mmap
+ * paths, DONTNEED over everything pending saves the next eviction, and
+ * NOREUSE on an evict-behind file hands it to the kernel where that works.
+ */
+int posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+	struct nocache_fd *nf;
+	int ret;
+
+	NOCACHE_STAT(posix_fadvise, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(posix_fadvise, posix_fadvise64);
+	nf = nocache_fd_get(fd);
+	ret = libc_posix_fadvise(fd, offset, len, advice);
+	if (ret != 0 || nf == NULL || (nf->flags & NOCACHE_FD_SKIP) != 0)
+		return ret;
+	switch (advice) {
+	case POSIX_FADV_NORMAL:
+	case POSIX_FADV_RANDOM:
+	case POSIX_FADV_SEQUENTIAL:
+		__atomic_store_n(&nf->hint, advice, __ATOMIC_RELAXED);
+		break;
+	case POSIX_FADV_DONTNEED:
+		if (!nocache_fd_trylock(nf))
+			break;
+		if (nf->pending != 0 && nf->wlo == nf->whi && offset <= nf->lo
+		&& (len == 0 || (nf->hi != NOCACHE_EOF && offset + len >= nf->hi)))
+			nf->pending = 0;
+		nocache_fd_unlock(nf);
+		break;
+	case POSIX_FADV_NOREUSE:
+		if (!nocache_noreuse || nf->policy != NOCACHE_POLICY_BEHIND)
+			break;
+		nocache_fd_flush(fd, 0, "posix_fadvise(POSIX_FADV_DONTNEED) inside posix_fadvise()");
+		nocache_budget_drop(fd);
+		__atomic_or_fetch(&nf->flags, NOCACHE_FD_SKIP, __ATOMIC_RELAXED);
+		NOCACHE_STAT(noreuse, 1);
+		break;
+	}
+	return ret;
+}
+NOCACHE_ALIAS64(posix_fadvise, posix_fadvise64);
+
+ssize_t vmsplice(int fd, const struct iovec *iov, unsigned long nr_segs, unsigned int flags)
+{
+	NOCACHE_STAT(vmsplice, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(vmsplice);
+	return libc_vmsplice(fd, iov, nr_segs, flags);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags)
+{
+	ssize_t ret;
+	off_t in = off_in != NULL ? *off_in : NOCACHE_OFF_CUR;
+	off_t out = off_out != NULL ? *off_out : NOCACHE_OFF_CUR;
+
+	NOCACHE_STAT(splice, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(splice);
+	ret = libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	if (ret < 0 && nocache_direct_refused(fd_in, fd_out))
+		ret = libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	if (ret > 0) {
+		nocache_fd_io(fd_in, in, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside splice()");
+		nocache_fd_io(fd_out, out, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside splice()");
+	}
+	return ret;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	ssize_t ret;
+	off_t in = offset != NULL ? *offset : NOCACHE_OFF_CUR;
+
+	NOCACHE_STAT(sendfile, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(sendfile, sendfile64);
+	ret = libc_sendfile(out_fd, in_fd, offset, count);
+	if (ret < 0 && nocache_direct_refused(in_fd, out_fd))
+		ret = libc_sendfile(out_fd, in_fd, offset, count);
+	if (ret > 0) {
+		nocache_fd_io(in_fd, in, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside sendfile()");
+		nocache_fd_io(out_fd, NOCACHE_OFF_CUR, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside sendfile()");
+	}
+	return ret;
+}
+
+NOCACHE_ALIAS64(sendfile, sendfile64);
+
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+	ssize_t ret;
+
+	NOCACHE_STAT(preadv2, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(preadv2, preadv64v2);
+	if (flags == 0)
+		NOCACHE_DIRECT_IO(fd, iov, iovcnt, nocache_iov_len(iov, iovcnt), offset < 0 ? NOCACHE_OFF_CUR : offset, NOCACHE_IO_READ);
+	ret = libc_preadv2(fd, iov, iovcnt, offset, flags);
+	if (ret > 0)
+		nocache_fd_io(fd, offset < 0 ? NOCACHE_OFF_CUR : offset, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside preadv2()");
+	return ret;
+}
+NOCACHE_ALIAS64(preadv2, preadv64v2);
+
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+	ssize_t ret;
+
+	NOCACHE_STAT(pwritev2, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(pwritev2, pwritev64v2);
+	if (flags == 0)
+		NOCACHE_DIRECT_IO(fd, iov, iovcnt, nocache_iov_len(iov, iovcnt), offset < 0 ? NOCACHE_OFF_CUR : offset, NOCACHE_IO_WRITE);
+	ret = libc_pwritev2(fd, iov, iovcnt, offset, flags);
+	if (ret > 0)
+		nocache_fd_io(fd, offset < 0 ? NOCACHE_OFF_CUR : offset, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside pwritev2()");
+	return ret;
+}
+NOCACHE_ALIAS64(pwritev2, pwritev64v2);
+
+ssize_t copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags)
+{
+	ssize_t ret;
+	off_t in = off_in != NULL ? *off_in : NOCACHE_OFF_CUR;
+	off_t out = off_out != NULL ? *off_out : NOCACHE_OFF_CUR;
+
+	NOCACHE_STAT(copy_file_range, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(copy_file_range);
+	ret = libc_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+	if (ret < 0 && nocache_direct_refused(fd_in, fd_out))
+		ret = libc_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+	if (ret > 0) {
+		nocache_fd_io(fd_in, in, ret, NOCACHE_IO_READ, "posix_fadvise(POSIX_FADV_DONTNEED) inside copy_file_range()");
+		nocache_fd_io(fd_out, out, ret, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside copy_file_range()");
+	}
+	return ret;
+}
+
+/* Only zeroing leaves pages behind, allocation does not populate the cache and punching drops it */
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+	int ret;
+
+	NOCACHE_STAT(fallocate, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(fallocate, fallocate64);
+	ret = libc_fallocate(fd, mode, offset, len);
+	if (ret == 0 && (mode & FALLOC_FL_ZERO_RANGE) != 0 && len > 0)
+		nocache_fd_io(fd, offset, len, NOCACHE_IO_WRITE, "posix_fadvise(POSIX_FADV_DONTNEED) inside fallocate()");
+	return ret;
+}
+NOCACHE_ALIAS64(fallocate, fallocate64);
+
+FILE *fopen(const char *pathname, const char *mode)
+{
+	FILE *stream;
+
+	NOCACHE_STAT(fopen, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(fopen, fopen64);
+	stream = libc_fopen(pathname, mode);
+	if (stream != NULL)
+		nocache_fd_open(fileno(stream), pathname, strchr(mode, 'a') != NULL ? O_APPEND : 0);
+	return stream;
+}
+NOCACHE_ALIAS64(fopen, fopen64);
+
+FILE *freopen(const char *pathname, const char *mode, FILE *stream)
+{
+	NOCACHE_STAT(freopen, 1);
+	COND_ASSIGN_DLSYM64_OR_DIE(freopen, freopen64);
+	if (stream != NULL)
+		nocache_stdio_close(stream, 1);
+	stream = libc_freopen(pathname, mode, stream);
+	if (stream != NULL && pathname != NULL)
+		nocache_fd_open(fileno(stream), pathname, strchr(mode, 'a') != NULL ? O_APPEND : 0);
+	return stream;
+}
+NOCACHE_ALIAS64(freopen, freopen64);
+
+int fclose(FILE *stream)
+{
+	NOCACHE_STAT(fclose, 1);
+	COND_ASSIGN_DLSYM_OR_DIE(fclose);
+	if (stream != NULL)
+		nocache_stdio_close(stream, 1);
+	return libc_fclose(stream);
+}
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	size_t ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fread);
+	ret = libc_fread(ptr, size, nmemb, stream);
+	nocache_stdio(stream, ret * size, NOCACHE_IO_READ);
+	return ret;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	size_t ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fwrite);
+	ret = libc_fwrite(ptr, size, nmemb, stream);
+	nocache_stdio(stream, ret * size, NOCACHE_IO_WRITE);
+	return ret;
+}
+
+size_t (fread_unlocked)(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	size_t ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fread_unlocked);
+	ret = libc_fread_unlocked(ptr, size, nmemb, stream);
+	nocache_stdio(stream, ret * size, NOCACHE_IO_READ);
+	return ret;
+}
+
+size_t (fwrite_unlocked)(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	size_t ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fwrite_unlocked);
+	ret = libc_fwrite_unlocked(ptr, size, nmemb, stream);
+	nocache_stdio(stream, ret * size, NOCACHE_IO_WRITE);
+	return ret;
+}
+
+char *fgets(char *s, int size, FILE *stream)
+{
+	char *ret;
 
+	COND_ASSIGN_DLSYM_OR_DIE(fgets);
+	ret = libc_fgets(s, size, stream);
+	if (ret != NULL)
+		nocache_stdio(stream, strlen(ret), NOCACHE_IO_READ);
+	return ret;
+}
+
+char *fgets_unlocked(char *s, int size, FILE *stream)
+{
+	char *ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fgets_unlocked);
+	ret = libc_fgets_unlocked(s, size, stream);
+	if (ret != NULL)
+		nocache_stdio(stream, strlen(ret), NOCACHE_IO_READ);
+	return ret;
+}
+
+int fputs(const char *s, FILE *stream)
+{
+	int ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fputs);
+	ret = libc_fputs(s, stream);
+	if (ret >= 0)
+		nocache_stdio(stream, strlen(s), NOCACHE_IO_WRITE);
+	return ret;
+}
+
+int fputs_unlocked(const char *s, FILE *stream)
+{
+	int ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(fputs_unlocked);
+	ret = libc_fputs_unlocked(s, stream);
+	if (ret >= 0)
+		nocache_stdio(stream, strlen(s), NOCACHE_IO_WRITE);
+	return ret;
+}
+
+ssize_t getline(char **lineptr, size_t *n, FILE *stream)
+{
+	ssize_t ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(getline);
+	ret = libc_getline(lineptr, n, stream);
+	if (ret > 0)
+		nocache_stdio(stream, ret, NOCACHE_IO_READ);
+	return ret;
+}
+
+ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream)
+{
+	ssize_t ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(getdelim);
+	ret = libc_getdelim(lineptr, n, delim, stream);
+	if (ret > 0)
+		nocache_stdio(stream, ret, NOCACHE_IO_READ);
+	return ret;
+}
+
+int vfprintf(FILE *stream, const char *format, va_list ap)
+{
+	int ret;
+
+	COND_ASSIGN_DLSYM_OR_DIE(vfprintf);
+	ret = libc_vfprintf(stream, format, ap);
+	if (ret > 0)
+		nocache_stdio(stream, ret, NOCACHE_IO_WRITE);
+	return ret;
+}
+
+int fprintf(FILE *stream, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = vfprintf(stream, format, ap);
+	va_end(ap);
+	return ret;
+}
+
+#if __SIZEOF_LONG__ != 8
+/*
+ * Plain entry points taking a 32-bit off_t.  open(), openat(), fopen(),
+ * freopen() and lseek() call their own libc versions, which differ in
+ * O_LARGEFILE and overflow checks; the rest widen the offset and go
+ * through the hooks above.
+ */
+#define COND_ASSIGN_DLSYM32_OR_DIE(name)				\
+	do {								\
+		if (libc_##name##32 == NULL) {				\
+			*(void **)(&libc_##name##32) = dlsym(RTLD_NEXT, #name);	\
+			if (libc_##name##32 == NULL)			\
+			_exit(EXIT_FAILURE);					\
+		}							\
+	} while (0)
+
+static int (*libc_open32)(const char *, int, ...) = NULL;
+static int (*libc_openat32)(int, const char *, int, ...) = NULL;
+static FILE *(*libc_fopen32)(const char *, const char *) = NULL;
+static FILE *(*libc_freopen32)(const char *, const char *, FILE *) = NULL;
+static long (*libc_lseek32)(int, long, int) = NULL;
+
+int nocache_open32(const char *pathname, int flags, ...) __asm__("open");
+int nocache_openat32(int dirfd, const char *pathname, int flags, ...) __asm__("openat");
+FILE *nocache_fopen32(const char *pathname, const char *mode) __asm__("fopen");
+FILE *nocache_freopen32(const char *pathname, const char *mode, FILE *stream) __asm__("freopen");
+long nocache_lseek32(int fd, long offset, int whence) __asm__("lseek");
+ssize_t nocache_pread32(int fd, void *buf, size_t count, long offset) __asm__("pread");
+ssize_t nocache_pwrite32(int fd, const void *buf, size_t count, long offset) __asm__("pwrite");
+ssize_t nocache_preadv32(int fd, const struct iovec *iov, int iovcnt, long offset) __asm__("preadv");
+ssize_t nocache_pwritev32(int fd, const struct iovec *iov, int iovcnt, long offset) __asm__("pwritev");
+ssize_t nocache_preadv232(int fd, const struct iovec *iov, int iovcnt, long offset, int flags) __asm__("preadv2");
+ssize_t nocache_pwritev232(int fd, const struct iovec *iov, int iovcnt, long offset, int flags) __asm__("pwritev2");
+void *nocache_mmap32(void *addr, size_t length, int prot, int flags, int fd, long offset) __asm__("mmap");
+int nocache_fallocate32(int fd, int mode, long offset, long len) __asm__("fallocate");
+int nocache_posix_fadvise32(int fd, long offset, long len, int advice) __asm__("posix_fadvise");
+ssize_t nocache_sendfile32(int out_fd, int in_fd, long *offset, size_t count) __asm__("sendfile");
+
+int nocache_open32(const char *pathname, int flags, ...)
+{
+	va_list ap;
+	int fd;
+	mode_t mode = 0;
+
+	va_start(ap, flags);
+	if ((flags & O_CREAT) != 0)
+		mode = va_arg(ap, mode_t);
+	va_end(ap);
+	NOCACHE_STAT(open, 1);
+	COND_ASSIGN_DLSYM32_OR_DIE(open);
+	fd = libc_open32(pathname, flags, mode);
+	if (fd >= 0)
+		nocache_fd_open(fd, pathname, flags);
+	return fd;
+}
+
+int nocache_openat32(int dirfd, const char *pathname, int flags, ...)
+{
+	va_list ap;
+	int fd;
+	mode_t mode = 0;
+
+	va_start(ap, flags);
+	if ((flags & O_CREAT) != 0)
+		mode = va_arg(ap, mode_t);
+	va_end(ap);
+	NOCACHE_STAT(openat, 1);
+	COND_ASSIGN_DLSYM32_OR_DIE(openat);
+	fd = libc_openat32(dirfd, pathname, flags, mode);
+	if (fd >= 0)
+		nocache_fd_open(fd, pathname, flags);
+	return fd;
+}
+
+FILE *nocache_fopen32(const char *pathname, const char *mode)
+{
+	FILE *stream;
+
+	NOCACHE_STAT(fopen, 1);
+	COND_ASSIGN_DLSYM32_OR_DIE(fopen);
+	stream = libc_fopen32(pathname, mode);
+	if (stream != NULL)
+		nocache_fd_open(fileno(stream), pathname, strchr(mode, 'a') != NULL ? O_APPEND : 0);
+	return stream;
+}
+
+FILE *nocache_freopen32(const char *pathname, const char *mode, FILE *stream)
+{
+	NOCACHE_STAT(freopen, 1);
+	COND_ASSIGN_DLSYM32_OR_DIE(freopen);
+	if (stream != NULL)
+		nocache_stdio_close(stream, 1);
+	stream = libc_freopen32(pathname, mode, stream);
+	if (stream != NULL && pathname != NULL)
+		nocache_fd_open(fileno(stream), pathname, strchr(mode, 'a') != NULL ? O_APPEND : 0);
+	return stream;
+}
+
+long nocache_lseek32(int fd, long offset, int whence)
+{
+	long ret;
+
+	NOCACHE_STAT(lseek, 1);
+	COND_ASSIGN_DLSYM32_OR_DIE(lseek);
+	ret = libc_lseek32(fd, offset, whence);
+	if (ret >= 0)
+		nocache_fd_seek(fd, ret);
+	return ret;
+}
+
+ssize_t nocache_pread32(int fd, void *buf, size_t count, long offset)
+{
+	return pread(fd, buf, count, offset);
+}
+
+ssize_t nocache_pwrite32(int fd, const void *buf, size_t count, long offset)
+{
+	return pwrite(fd, buf, count, offset);
+}
+
+ssize_t nocache_preadv32(int fd, const struct iovec *iov, int iovcnt, long offset)
+{
+	return preadv(fd, iov, iovcnt, offset);
+}
+
+ssize_t nocache_pwritev32(int fd, const struct iovec *iov, int iovcnt, long offset)
+{
+	return pwritev(fd, iov, iovcnt, offset);
+}
+
+ssize_t nocache_preadv232(int fd, const struct iovec *iov, int iovcnt, long offset, int flags)
+{
+	return preadv2(fd, iov, iovcnt, offset, flags);
+}
+
+ssize_t nocache_pwritev232(int fd, const struct iovec *iov, int iovcnt, long offset, int flags)
+{
+	return pwritev2(fd, iov, iovcnt, offset, flags);
+}
+
+void *nocache_mmap32(void *addr, size_t length, int prot, int flags, int fd, long offset)
+{
+	return mmap(addr, length, prot, flags, fd, offset);
+}
+
+int nocache_fallocate32(int fd, int mode, long offset, long len)
+{
+	return fallocate(fd, mode, offset, len);
+}
+
+int nocache_posix_fadvise32(int fd, long offset, long len, int advice)
+{
+	return posix_fadvise(fd, offset, len, advice);
+}
+
+ssize_t nocache_sendfile32(int out_fd, int in_fd, long *offset, size_t count)
+{
+	off_t off;
+	ssize_t ret;
+
+	if (offset == NULL)
+		return sendfile(out_fd, in_fd, NULL, count);
+	off = *offset;
+	ret = sendfile(out_fd, in_fd, &off, count);
+	if (ret >= 0)
+		*offset = off;
+	return ret;
+}
+#endif
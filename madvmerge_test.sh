@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# madvmerge_test.sh [count]
+# Run ./madvmergebench check under madvmerge.sh with the default settings and
+# with MADVMERGE_MIN=64K MADVMERGE_REGIONS=mmap,brk,anon-large: blocks freed
+# and allocated again at the same addresses must still show mg in smaps.
+# Exits non-zero if any of them does not.
+
+p="$0"
+d="${p%/*}"
+[[ "$d" == "$p" ]] && d="./" || d="$d/"
+m="${d}madvmerge.sh"
+b="${d}madvmergebench"
+[[ -x "$m" && -x "$b" ]] || exit
+
+r="0"
+check()
+{
+	echo -n "$* "
+	env "$@" "$m" "$b" check "$z" || r="1"
+}
+
+z="${1:-50}"
+check MADVMERGE_REGIONS=all
+check MADVMERGE_MIN=64K MADVMERGE_REGIONS=mmap,brk,anon-large
+
+exit "$r"
@@ -0,0 +1,149 @@
+/*
+	This file is part of miscutil.
+	Copyright (C) 2012-2018, Robert L. Thompson
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * malloc()/free() microbenchmark for libmadvmerge.so: run it as
+ * ./madvmerge.sh ./madvmergebench [count [max_size [live]]] and compare with a
+ * plain run.  madvise() is defined here, so the calls libmadvmerge.so makes
+ * bind to it and are counted.  ./madvmergebench check [count] instead frees
+ * and reallocates blocks glibc maps on their own and blocks it trims off the
+ * heap, and fails unless smaps shows every one of them mergeable.
+ */
+static unsigned long calls;
+
+int madvise(void *addr, size_t len, int advice)
+{
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+	return syscall(SYS_madvise, addr, len, advice);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 1 if the mapping holding addr has the mg VmFlag, 0 if not, -1 if not found */
+static int mergeable(void *addr)
+{
+	FILE *fp;
+	char line[4096];
+	unsigned long lo, hi;
+	int in = 0, ret = -1;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof line, fp) != NULL) {
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+			in = (uintptr_t)addr >= lo && (uintptr_t)addr < hi;
+		else if (in && strncmp(line, "VmFlags:", 8) == 0) {
+			ret = strstr(line, " mg") != NULL;
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+static int check(long n)
+{
+	void *p, *heap[8];
+	long i, j, mapped = 0, trimmed = 0;
+
+	/* 1M blocks get a mapping of their own, unmapped again by free() */
+	mallopt(M_MMAP_THRESHOLD, 128 << 10);
+	for (i = 0; i < n; i++) {
+		p = malloc(1 << 20);
+		if (p == NULL)
+			return EXIT_FAILURE;
+		mapped += mergeable(p) != 1;
+		free(p);
+	}
+	/* 256K blocks on the heap, trimmed off its top when freed last to first */
+	mallopt(M_MMAP_THRESHOLD, 4 << 20);
+	mallopt(M_TRIM_THRESHOLD, 128 << 10);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < 8; j++)
+			if ((heap[j] = malloc(256 << 10)) == NULL)
+				return EXIT_FAILURE;
+		for (j = 0; j < 8; j++)
+			trimmed += mergeable(heap[j]) != 1;
+		for (j = 7; j >= 0; j--)
+			free(heap[j]);
+	}
+	printf("unmergeable: %ld of %ld mapped blocks, %ld of %ld heap blocks after a trim\n",
+		mapped, n, trimmed, n * 8);
+	return mapped == 0 && trimmed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	long n = 1000000, size = 2000, live = 64, i;
+	void **keep;
+	uint64_t t;
+	unsigned long before;
+
+	if (argc > 1 && strcmp(argv[1], "check") == 0)
+		return check(argc > 2 ? atol(argv[2]) : 50);
+	if (argc > 4) {
+		fprintf(stderr, "%s [count [max_size [live]]] | check [count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 1)
+		n = atol(argv[1]);
+	if (argc > 2)
+		size = atol(argv[2]);
+	if (argc > 3)
+		live = atol(argv[3]);
+	if (n <= 0 || size < 16 || live <= 0)
+		return EXIT_FAILURE;
+	keep = calloc(live, sizeof *keep);
+	if (keep == NULL) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+
+	before = calls;
+	t = now_ns();
+	for (i = 0; i < n; i++) {
+		free(keep[i % live]);
+		keep[i % live] = malloc(16 + (i * 37) % (size - 15));
+	}
+	t = now_ns() - t;
+	printf("%ld mallocs of 16-%ld bytes, %ld live: %.1f ns/op, %lu madvise calls\n",
+		n, size, live, (double)t / n, calls - before);
+
+	for (i = 0; i < live; i++)
+		free(keep[i]);
+	free(keep);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env bash
+# nocache_bench.sh calls|direct|age [file [size_mib]]
+# calls: advice calls per GiB of a dd bs=4k copy through libnocache.so, per
+# NOCACHE_BATCH, against evicting after every call.
+# direct: seconds for cold and warm dd reads, cp and dd writes, evict-behind
+# against NOCACHE_DEFAULT=direct, with the pages of the file left resident.
+# age: disk reads and seconds for reading the file twice in one cat from a cold
+# cache, and seconds for a warm dd bs=4k, without the library, with evict-behind
+# and with NOCACHE_AGE=2000.
+# The file is created (default 256 MiB) when missing and removed afterwards.
+
+p="$0"
+d="${p%/*}"
+[[ "$d" == "$p" ]] && d="./" || d="$d/"
+n="${d}nocache.sh"
+[[ -x "$n" ]] || exit
+
+m="$1"
+f="${2:-nocache_bench.dat}"
+z="${3:-256}"
+[[ "$m" == "calls" || "$m" == "direct" || "$m" == "age" ]] || { echo "$0 calls|direct|age [file [size_mib]]" >&2; exit 1; }
+
+c=""
+if [[ ! -e "$f" ]]
+then
+	dd if=/dev/urandom of="$f" bs=1M count="$z" status=none || exit
+	c="_"
+fi
+b="`stat -c %s "$f"`" || exit
+s="`mktemp`" || exit
+o="$f.out"
+trap 'rm -f "$s" "$o"; [[ "$c" ]] && rm -f "$f"' EXIT
+
+# Last line is the process itself, dd spawns nothing
+stat_of()
+{
+	tail -n 1 "$s" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+# Drop the file from the page cache without root
+uncache()
+{
+	dd if="$1" iflag=nocache count=0 status=none
+}
+
+# Wall seconds of a command run under nocache.sh with the given policy
+timed()
+{
+	local t="$1"
+
+	shift
+	TIMEFORMAT="%R"
+	{ time NOCACHE_DEFAULT="$t" "$n" "$@" > /dev/null 2>&1; } 2>&1
+}
+
+# KiB read from disk so far
+pgpgin()
+{
+	sed -n 's/^pgpgin //p' /proc/vmstat
+}
+
+if [[ "$m" == "calls" ]]
+then
+	# batch/align/writebehind; batch 0 with no alignment is the old evict-after-every-call
+	# behaviour, sync_file_range() only comes with write-behind
+	printf '%-8s %-6s %-7s %10s %10s %12s\n' batch align wbehind fadvise sfr per_GiB
+	for t in 0/0/0 0/2M/0 8M/2M/0 32M/2M/0 128M/2M/0 8M/2M/8M
+	do
+		x=( ${t//\// } )
+		rm -f "$o"
+		: > "$s"
+		NOCACHE_BATCH="${x[0]}" NOCACHE_ALIGN="${x[1]}" NOCACHE_WRITEBEHIND="${x[2]}" NOCACHE_STATS="$s" \
+			"$n" dd if="$f" of="$o" bs=4k status=none || exit
+		a="`stat_of fadvise`"
+		w="`stat_of sync_range`"
+		printf '%-8s %-6s %-7s %10d %10d %12d\n' "${x[@]}" "${a:-0}" "${w:-0}" "$(( (${a:-0} + ${w:-0}) * 1073741824 / b ))"
+	done
+fi
+
+if [[ "$m" == "direct" ]]
+then
+	printf '%-14s %-7s %8s %8s %8s %9s\n' test policy run1 run2 run3 resident
+	for t in behind direct
+	do
+		for x in "cold dd-1M" "cold dd-64K" "cold cp" "warm dd-1M" "write dd-1M"
+		do
+			v=()
+			for i in 1 2 3
+			do
+				rm -f "$o"
+				case "$x" in
+				cold*) uncache "$f" ;;
+				warm*) cat "$f" > /dev/null ;;
+				esac
+				case "$x" in
+				write*) v+=( "`timed "$t" dd if=/dev/zero of="$o" bs=1M count="$(( b >> 20 ))" conv=fsync`" ) ;;
+				*dd-1M) v+=( "`timed "$t" dd if="$f" of=/dev/null bs=1M`" ) ;;
+				*dd-64K) v+=( "`timed "$t" dd if="$f" of=/dev/null bs=64K`" ) ;;
+				*cp) v+=( "`timed "$t" cp --reflink=never "$f" "$o"`" ) ;;
+				esac
+			done
+			[[ "$x" == write* ]] && r="$o" || r="$f"
+			printf '%-14s %-7s %8s %8s %8s %9s\n' "$x" "$t" "${v[@]}" "`fincore --raw --noheadings --output PAGES "$r"`"
+		done
+	done
+fi
+
+if [[ "$m" == "age" ]]
+then
+	printf '%-10s %12s %10s %10s\n' mode reread_MiB reread_s dd4k_s
+	for t in native behind age
+	do
+		case "$t" in
+		native) e=( env ) ;;
+		behind) e=( env NOCACHE_DEFAULT=behind "$n" ) ;;
+		age) e=( env NOCACHE_DEFAULT=behind NOCACHE_AGE=2000 "$n" ) ;;
+		esac
+		uncache "$f"
+		a="`pgpgin`"
+		TIMEFORMAT="%R"
+		r="`{ time "${e[@]}" cat "$f" "$f" > /dev/null; } 2>&1`"
+		a="$(( (`pgpgin` - a) / 1024 ))"
+		cat "$f" > /dev/null
+		w="`{ time "${e[@]}" dd if="$f" of=/dev/null bs=4k status=none; } 2>&1`"
+		printf '%-10s %12d %10s %10s\n' "$t" "$a" "$r" "$w"
+	done
+fi
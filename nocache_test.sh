@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+# nocache_test.sh [dir [size_mib]]
+# Run cat, cp, dd and a stdio program (sed) under nocache.sh on a cached file
+# in dir (default ., not tmpfs) and check with fincore that the file they read
+# is no longer cached afterwards.  Exits non-zero if any of them left pages.
+
+p="$0"
+d="${p%/*}"
+[[ "$d" == "$p" ]] && d="./" || d="$d/"
+n="${d}nocache.sh"
+[[ -x "$n" ]] || exit
+type fincore > /dev/null || exit
+
+t="${1:-.}"
+z="${2:-64}"
+s="`mktemp -p "$t" nocache_test.XXXXXX`" || exit
+o="$s.out"
+trap 'rm -f "$s" "$o"' EXIT
+
+dd if=/dev/urandom of="$s" bs=1M count="$z" status=none || exit
+sync "$s"
+
+pages()
+{
+	fincore --raw --noheadings --output PAGES "$1"
+}
+
+r="0"
+check()
+{
+	local c
+
+	rm -f "$o"
+	cat "$s" > /dev/null
+	c="`pages "$s"`"
+	[[ "$c" -gt 0 ]] || { echo "$1: source not cached before the run, is $t on tmpfs?"; r="1"; return; }
+	shift
+	"$n" "$@" > /dev/null || { echo "$*: failed"; r="1"; return; }
+	c="`pages "$s"`"
+	[[ "$c" == "0" ]] && echo "ok   $* ($c pages left)" || { echo "FAIL $* ($c pages left)"; r="1"; }
+}
+
+check cat cat "$s"
+check cp cp --reflink=never "$s" "$o"
+check dd dd if="$s" of="$o" bs=1M status=none
+check sed sed -n "\$p" "$s"
+
+exit "$r"
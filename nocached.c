@@ -0,0 +1,298 @@
+/*
+	This file is part of miscutil.
+	Copyright (C) 2012-2018, Robert L. Thompson
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Same layout as the messages sent by libnocache.so with NOCACHE_DAEMON */
+#define DAEMON_VERSION	1
+
+struct daemon_msg {
+	uint32_t version;
+	uint32_t pid;
+	int64_t off;
+	int64_t len;
+};
+
+/* One file waiting for eviction, requests from any process merged into the span [lo, hi) */
+struct pending {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	off_t lo, hi;
+	uint64_t due;
+};
+
+#define EOF_OFF		((off_t)-1)
+
+/* Descriptors accepted per datagram, only to close the extra ones a bad client sends */
+#define MAX_FDS		16
+
+static struct pending *pend;
+static int npend, maxpend = 1024;
+static uint64_t delay = 100, rate = 1000, tokens, refill;
+static uint64_t nmsg, nmerged, nevict, nbad;
+static volatile sig_atomic_t quit;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void evict(int i)
+{
+	struct pending *p = &pend[i];
+	off_t len = p->hi == EOF_OFF ? 0 : p->hi - p->lo;
+
+	if (posix_fadvise(p->fd, p->lo, len, POSIX_FADV_DONTNEED) != 0)
+		nbad++;
+	else
+		nevict++;
+	close(p->fd);
+	*p = pend[--npend];
+}
+
+static void request(int fd, const struct daemon_msg *msg)
+{
+	struct stat st;
+	struct pending *p;
+	off_t lo = msg->off, hi = msg->len == 0 ? EOF_OFF : msg->off + msg->len;
+	int i, oldest = 0;
+
+	if (fstat(fd, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) || lo < 0) {
+		nbad++;
+		close(fd);
+		return;
+	}
+	for (i = 0; i < npend; i++) {
+		p = &pend[i];
+		if (p->dev != st.st_dev || p->ino != st.st_ino) {
+			if (p->due < pend[oldest].due)
+				oldest = i;
+			continue;
+		}
+		if (lo < p->lo)
+			p->lo = lo;
+		if (p->hi != EOF_OFF && (hi == EOF_OFF || hi > p->hi))
+			p->hi = hi;
+		nmerged++;
+		close(fd);
+		return;
+	}
+	/* Full table, the oldest request goes now whatever the rate */
+	if (npend == maxpend)
+		evict(oldest);
+	p = &pend[npend++];
+	p->fd = fd;
+	p->dev = st.st_dev;
+	p->ino = st.st_ino;
+	p->lo = lo;
+	p->hi = hi;
+	p->due = now_ms() + delay;
+}
+
+static void receive(int sock)
+{
+	struct daemon_msg msg;
+	struct iovec iov = { &msg, sizeof msg };
+	union {
+		char buf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	ssize_t len;
+	int fds[MAX_FDS], nfds, i, n;
+
+	for (;;) {
+		memset(&mh, 0, sizeof mh);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof ctl.buf;
+		len = recvmsg(sock, &mh, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+		if (len < 0)
+			break;
+		nmsg++;
+		nfds = 0;
+		for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+				continue;
+			n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (i = 0; i < n && nfds < MAX_FDS; i++)
+				memcpy(&fds[nfds++], CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+		}
+		if (nfds == 0 && (mh.msg_flags & MSG_CTRUNC) == 0)
+			continue;
+		/* Whatever was installed is closed unless it is exactly one fd with a whole message */
+		if (nfds != 1 || (mh.msg_flags & (MSG_CTRUNC|MSG_TRUNC)) != 0
+		|| len != sizeof msg || msg.version != DAEMON_VERSION) {
+			nbad++;
+			for (i = 0; i < nfds; i++)
+				close(fds[i]);
+			continue;
+		}
+		request(fds[0], &msg);
+	}
+}
+
+/* Evict what is due as far as the token bucket allows, return ms until the next attempt or -1 */
+static int expire(void)
+{
+	uint64_t t = now_ms(), next = UINT64_MAX, add;
+	int i;
+
+	/* refill only moves by the time turned into whole tokens, the rest carries over */
+	if (rate != 0 && t > refill) {
+		add = (t - refill) * rate / 1000;
+		tokens += add;
+		refill += add * 1000 / rate;
+		if (tokens >= rate) {
+			tokens = rate;
+			refill = t;
+		}
+	}
+	for (i = 0; i < npend; ) {
+		if (pend[i].due > t || (rate != 0 && tokens == 0)) {
+			if (pend[i].due < next)
+				next = pend[i].due;
+			i++;
+			continue;
+		}
+		if (rate != 0)
+			tokens--;
+		evict(i);
+	}
+	if (next == UINT64_MAX)
+		return -1;
+	if (rate != 0 && tokens == 0 && next <= t)
+		next = t + (1000 + rate - 1) / rate;
+	return next > t ? (int)(next - t) : 0;
+}
+
+static void stop(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_FAILURE, sock = -1, opt, timeout;
+	struct sockaddr_un sun;
+	struct pollfd pfd;
+	struct rlimit rl;
+	struct sigaction sa;
+	struct stat st;
+	const char *path;
+
+	while ((opt = getopt(argc, argv, "d:n:r:")) != -1) {
+		switch (opt) {
+		case 'd': delay = strtoull(optarg, NULL, 0); break;
+		case 'n': maxpend = atoi(optarg); break;
+		case 'r': rate = strtoull(optarg, NULL, 0); break;
+		default: goto usage;
+		}
+	}
+	if (optind != argc - 1 || maxpend <= 0) {
+usage:
+		fprintf(stderr, "%s [-d delay_ms] [-n max_files] [-r evictions_per_s] socket\n", argv[0]);
+		goto fail;
+	}
+	path = argv[optind];
+
+	/* Every pending file holds a descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+	&& (rlim_t)maxpend > rl.rlim_cur - 16)
+		maxpend = rl.rlim_cur > 32 ? rl.rlim_cur - 16 : 16;
+	pend = calloc(maxpend, sizeof *pend);
+	if (pend == NULL) {
+		perror("calloc()");
+		goto fail;
+	}
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun.sun_path) {
+		fprintf(stderr, "Socket path too long\n");
+		goto fail;
+	}
+	strcpy(sun.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket()");
+		goto fail;
+	}
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	umask(077);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof sun) != 0) {
+		perror("bind()");
+		goto fail;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	tokens = rate;
+	refill = now_ms();
+	timeout = -1;
+	while (!quit) {
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) > 0)
+			receive(sock);
+		timeout = expire();
+	}
+	while (npend > 0)
+		evict(npend - 1);
+	fprintf(stderr, "nocached messages=%llu merged=%llu evicted=%llu failed=%llu\n",
+		(unsigned long long)nmsg, (unsigned long long)nmerged,
+		(unsigned long long)nevict, (unsigned long long)nbad);
+	unlink(path);
+	ret = EXIT_SUCCESS;
+fail:
+	if (sock >= 0)
+		close(sock);
+	free(pend);
+	return ret;
+}
@@ -0,0 +1,142 @@
+/*
+	This file is part of miscutil.
+	Copyright (C) 2012-2018, Robert L. Thompson
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Same layout as the NOCACHE_TRACE records written by libnocache.so */
+#define TRACE_MAGIC	"NCTRACE1"
+
+struct trace_rec {
+	uint64_t ns;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t cached;
+	uint64_t dirty;
+	uint32_t pid;
+	uint32_t pagesize;
+};
+
+static ssize_t readfd(int fd, char *buf, size_t size)
+{
+	size_t len = size;
+	ssize_t rlen;
+
+	do {
+		rlen = read(fd, buf, len);
+		if (rlen < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read()");
+			goto fail;
+		}
+		if (rlen == 0)
+			break;
+		buf += rlen;
+		len -= rlen;
+	} while (len > 0);
+
+	rlen = size - len;
+fail:
+	return rlen;
+}
+
+static void print_count(uint64_t pages, uint64_t scale)
+{
+	if (pages == UINT64_MAX)
+		fputs("-", stdout);
+	else
+		printf("%llu", (unsigned long long)(pages * scale));
+}
+
+static bool decode(int fd, bool bytes)
+{
+	struct trace_rec rec;
+	ssize_t rlen;
+
+	printf("time\tpid\tdev\tino\t%s\t%s\n", bytes ? "cached_bytes" : "cached_pages",
+		bytes ? "dirty_bytes" : "dirty_pages");
+	for (;;) {
+		rlen = readfd(fd, (char *)&rec, sizeof rec);
+		if (rlen < 0)
+			return false;
+		if (rlen == 0)
+			break;
+		if (rlen != sizeof rec) {
+			fprintf(stderr, "Truncated record\n");
+			return false;
+		}
+		if (memcmp(&rec.ns, TRACE_MAGIC, sizeof rec.ns) == 0) {
+			if (rec.dev != sizeof rec) {
+				fprintf(stderr, "Record size %llu, expected %zu\n", (unsigned long long)rec.dev, sizeof rec);
+				return false;
+			}
+			continue;
+		}
+		printf("%llu.%09llu\t%lu\t%u:%u\t%llu\t", (unsigned long long)(rec.ns / 1000000000),
+			(unsigned long long)(rec.ns % 1000000000), (unsigned long)rec.pid,
+			major(rec.dev), minor(rec.dev), (unsigned long long)rec.ino);
+		print_count(rec.cached, bytes ? rec.pagesize : 1);
+		putchar('\t');
+		print_count(rec.dirty, bytes ? rec.pagesize : 1);
+		putchar('\n');
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_FAILURE, fd = STDIN_FILENO, arg = 1;
+	bool bytes = false;
+
+	if (arg < argc && strcmp(argv[arg], "-b") == 0) {
+		bytes = true;
+		arg++;
+	}
+	if (argc - arg > 1) {
+		fprintf(stderr, "%s [-b] [tracefile]\n", argv[0]);
+		goto fail;
+	}
+
+	if (arg < argc && strcmp(argv[arg], "-") != 0) {
+		fd = open(argv[arg], O_RDONLY);
+		if (fd < 0) {
+			perror("open()");
+			goto fail;
+		}
+	}
+
+	if (!decode(fd, bytes))
+		goto fail;
+
+	ret = EXIT_SUCCESS;
+fail:
+	if (fd > STDIN_FILENO)
+		close(fd);
+	return ret;
+}